@@ -15,8 +15,14 @@ LOCAL_CPPFLAGS := -Ofast -Wall -Wextra -Werror -std=c++14 -fexceptions
 LOCAL_CPP_FEATURES += exceptions
 LOCAL_LDLIBS := -llog -ldl -ljnigraphics
 LOCAL_SRC_FILES := src/parallelme/Buffer.cpp src/parallelme/Device.cpp \
-	src/parallelme/Kernel.cpp src/parallelme/Program.cpp \
+	src/parallelme/Event.cpp src/parallelme/Image.cpp \
+	src/parallelme/Kernel.cpp src/parallelme/KernelArgs.cpp \
+	src/parallelme/MemoryArena.cpp \
+	src/parallelme/MemoryPool.cpp src/parallelme/Profiler.cpp \
+	src/parallelme/Program.cpp \
 	src/parallelme/Runtime.cpp src/parallelme/Task.cpp \
 	src/parallelme/SchedulerFCFS.cpp src/parallelme/SchedulerHEFT.cpp \
-	src/parallelme/SchedulerPAMS.cpp src/parallelme/dynloader/dynLoader.c
+	src/parallelme/SchedulerPAMS.cpp src/parallelme/StagingRing.cpp \
+	src/parallelme/TransferEngine.cpp src/parallelme/WorkGroupTuner.cpp \
+	src/parallelme/dynloader/dynLoader.c
 include $(BUILD_SHARED_LIBRARY)
@@ -0,0 +1,33 @@
+###                                               _    __ ____
+ #   _ __  ___ _____   ___   __  __   ___ __     / |  / /  __/
+ #  |  _ \/ _ |  _  | / _ | / / / /  / __/ /    /  | / / /__
+ #  |  __/ __ |  ___|/ __ |/ /_/ /__/ __/ /__  / / v  / /__
+ #  |_| /_/ |_|_|\_\/_/ |_/____/___/___/____/ /_/  /_/____/
+ #
+ ##
+
+# Benchmark executables, built with the runtime by:
+#   ndk-build APP_BUILD_SCRIPT=benchmark/Android.mk
+# and run with adb shell from the directory they are pushed to.
+
+BENCHMARK_PATH := $(call my-dir)
+include $(BENCHMARK_PATH)/../Android.mk
+
+LOCAL_PATH := $(BENCHMARK_PATH)
+include $(CLEAR_VARS)
+LOCAL_MODULE := transferBenchmark
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include $(LOCAL_PATH)/../src/parallelme
+LOCAL_CPPFLAGS := -Ofast -Wall -Wextra -Werror -std=c++14 -fexceptions
+LOCAL_CPP_FEATURES += exceptions
+LOCAL_SRC_FILES := transferBenchmark.cpp
+LOCAL_SHARED_LIBRARIES := ParallelMERuntime
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := zeroCopyBenchmark
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include $(LOCAL_PATH)/../src/parallelme
+LOCAL_CPPFLAGS := -Ofast -Wall -Wextra -Werror -std=c++14 -fexceptions
+LOCAL_CPP_FEATURES += exceptions
+LOCAL_SRC_FILES := zeroCopyBenchmark.cpp
+LOCAL_SHARED_LIBRARIES := ParallelMERuntime
+include $(BUILD_EXECUTABLE)
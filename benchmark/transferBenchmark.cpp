@@ -0,0 +1,79 @@
+/*                                                _    __ ____
+ *   _ __  ___ _____   ___   __  __   ___ __     / |  / /  __/
+ *  |  _ \/ _ |  _  | / _ | / / / /  / __/ /    /  | / / /__
+ *  |  __/ __ |  ___|/ __ |/ /_/ /__/ __/ /__  / / v  / /__
+ *  |_| /_/ |_|_|\_\/_/ |_/____/___/___/____/ /_/  /_/____/
+ *
+ */
+
+/**
+ * Measures the bandwidth of the host copies of the TransferEngine against a
+ * single memcpy() for sizes around its thresholds and for large images.
+ * Usage: transferBenchmark [repetitions]
+ *
+ * @author Renato Utsch
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include "TransferEngine.hpp"
+using namespace parallelme;
+
+/// Returns the best bandwidth in MB/s of the copy over the repetitions.
+template<typename Copy>
+static double bandwidth(Copy copy, size_t size, unsigned repetitions) {
+    double best = 0.0;
+    for(unsigned i = 0; i < repetitions; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        copy();
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        best = std::max(best, size / elapsed.count() / (1024.0 * 1024.0));
+    }
+
+    return best;
+}
+
+int main(int argc, char **argv) {
+    unsigned repetitions = argc > 1 ? (unsigned) atoi(argv[1]) : 10;
+    if(!repetitions)
+        repetitions = 1;
+
+    const size_t sizes[] = {
+        64 * 1024, TransferEngine::StreamThreshold,
+        TransferEngine::ParallelThreshold, 16 * 1024 * 1024,
+        64 * 1024 * 1024, 200 * 1024 * 1024
+    };
+    auto &engine = TransferEngine::instance();
+
+    printf("%12s %14s %14s %8s\n", "bytes", "memcpy MB/s", "engine MB/s",
+            "speedup");
+    for(auto size : sizes) {
+        std::unique_ptr<char []> src(new char[size]);
+        std::unique_ptr<char []> dst(new char[size]);
+
+        // Touch the pages so that the first copy doesn't pay for faults.
+        memset(src.get(), 1, size);
+        memset(dst.get(), 0, size);
+
+        double plain = bandwidth([&] {
+            memcpy(dst.get(), src.get(), size);
+        }, size, repetitions);
+        double parallel = bandwidth([&] {
+            engine.copy(dst.get(), src.get(), size);
+        }, size, repetitions);
+        if(memcmp(dst.get(), src.get(), size)) {
+            fprintf(stderr, "The copy of %zu bytes is wrong.\n", size);
+            return 1;
+        }
+
+        printf("%12zu %14.0f %14.0f %7.2fx\n", size, plain, parallel,
+                parallel / plain);
+    }
+
+    return 0;
+}
@@ -0,0 +1,116 @@
+/*                                                _    __ ____
+ *   _ __  ___ _____   ___   __  __   ___ __     / |  / /  __/
+ *  |  _ \/ _ |  _  | / _ | / / / /  / __/ /    /  | / / /__
+ *  |  __/ __ |  ___|/ __ |/ /_/ /__/ __/ /__  / / v  / /__
+ *  |_| /_/ |_|_|\_\/_/ |_/____/___/___/____/ /_/  /_/____/
+ *
+ */
+
+/**
+ * Compares host access to HostVisibleMemory buffers through map() with the
+ * copies that setSource() and copyTo() make for DeviceMemory buffers, on the
+ * first CPU OpenCL device. Each round trip writes the data on the host, hands
+ * it to the device and reads it back.
+ * Usage: zeroCopyBenchmark [repetitions]
+ *
+ * @author Renato Utsch
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <parallelme/ParallelME.hpp>
+using namespace parallelme;
+
+/// Returns the best time in milliseconds of the round trip.
+template<typename RoundTrip>
+static double bestTime(RoundTrip roundTrip, unsigned repetitions) {
+    double best = 0.0;
+    for(unsigned i = 0; i < repetitions; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        roundTrip(i);
+        std::chrono::duration<double, std::milli> elapsed =
+            std::chrono::steady_clock::now() - start;
+        if(!i || elapsed.count() < best)
+            best = elapsed.count();
+    }
+
+    return best;
+}
+
+/// Returns true if all the bytes of data have the given value.
+static bool check(const unsigned char *data, size_t size,
+        unsigned char value) {
+    return std::all_of(data, data + size, [value](unsigned char byte) {
+        return byte == value;
+    });
+}
+
+int main(int argc, char **argv) {
+    unsigned repetitions = argc > 1 ? (unsigned) atoi(argv[1]) : 10;
+    if(!repetitions)
+        repetitions = 1;
+
+    Runtime runtime;
+    std::shared_ptr<Device> cpu;
+    for(auto &device : runtime.devices()) {
+        if(device->type() == Device::CPU) {
+            cpu = device;
+            break;
+        }
+    }
+    if(!cpu) {
+        fprintf(stderr, "There is no CPU OpenCL device.\n");
+        return 1;
+    }
+    printf("CPU device %s unified memory.\n",
+            cpu->hostUnifiedMemory() ? "has" : "doesn't have");
+
+    const size_t sizes[] = {
+        64 * 1024, 1024 * 1024, 16 * 1024 * 1024, 64 * 1024 * 1024
+    };
+
+    printf("%12s %12s %12s %8s\n", "bytes", "copy ms", "map ms", "speedup");
+    for(auto size : sizes) {
+        std::unique_ptr<unsigned char []> host(new unsigned char[size]);
+        memset(host.get(), 0, size);
+        bool valid = true;
+
+        auto copied = std::make_shared<Buffer>(size, Buffer::DeviceMemory);
+        double copy = bestTime([&](unsigned i) {
+            unsigned char value = (unsigned char) (i + 1);
+            memset(host.get(), value, size);
+            copied->setSource(host.get());
+            copied->prefetch(cpu);
+            memset(host.get(), 0, size);
+            copied->copyTo(host.get());
+            valid = valid && check(host.get(), size, value);
+        }, repetitions);
+
+        // map() needs a device to map from.
+        auto mapped = std::make_shared<Buffer>(size,
+                Buffer::HostVisibleMemory);
+        mapped->fill((unsigned char) 0, cpu);
+        double map = bestTime([&](unsigned i) {
+            unsigned char value = (unsigned char) (i + 1);
+            auto data = (unsigned char *) mapped->map();
+            memset(data, value, size);
+            mapped->prefetch(cpu);
+            data = (unsigned char *) mapped->map();
+            valid = valid && check(data, size, value);
+            mapped->unmap();
+        }, repetitions);
+
+        if(!valid) {
+            fprintf(stderr, "The round trip of %zu bytes is wrong.\n", size);
+            return 1;
+        }
+
+        printf("%12zu %12.3f %12.3f %7.2fx\n", size, copy, map, copy / map);
+    }
+
+    return 0;
+}
@@ -9,15 +9,24 @@
 #ifndef PARALLELME_BUFFER_HPP
 #define PARALLELME_BUFFER_HPP
 
+#include <atomic>
+#include <cstdint>
 #include <cstdlib>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
+#include <string>
+#include <vector>
 #include <jni.h>
 
 struct _cl_mem;
+struct _cl_event;
 
 namespace parallelme {
 class Device;
+class Event;
 class Worker;
 class Kernel;
 
@@ -53,17 +62,83 @@ class BufferEmptyError : public std::runtime_error {
  * Please pay attention to the saveCopyFrom functions: they don't make a
  * copy on the spot, instead saving a reference to the array, buffer or pointer
  * and only copying right before execution.
+ * Each device that uses the buffer keeps its own copy of it, so moving a
+ * buffer between devices only transfers data when the copy of the target
+ * device is outdated.
+ * Views created with view() share the memory of the buffer they were created
+ * from, so different tasks can work on parts of the same buffer.
  *
  * @author Renato Utsch
  */
-class Buffer {
+class Buffer : public std::enable_shared_from_this<Buffer> {
 
 public:
+    /**
+     * Where the memory of the buffer is allocated.
+     */
+    enum Allocation {
+        /// Memory owned by the device. Host accesses copy through a mapping.
+        DeviceMemory,
+
+        /// Memory that the host can access directly. On devices with unified
+        /// memory the buffer wraps aligned host storage, so mapping it makes
+        /// no copies. On other devices it is allocated as pinned memory.
+        HostVisibleMemory
+    };
+
+    /**
+     * How a kernel accesses a buffer argument.
+     * @see Kernel::setArg
+     */
+    enum Access {
+        /// The kernel only reads the buffer, so the copies of the buffer on
+        /// other devices stay up to date.
+        ReadOnly,
+
+        /// The kernel overwrites all of the buffer without reading it, so its
+        /// old contents aren't copied to the device.
+        WriteOnly,
+
+        /// The kernel reads and writes the buffer.
+        ReadWrite
+    };
+
+    /**
+     * A 2D region of a buffer that stores rows of rowPitch bytes.
+     */
+    struct Rect {
+        /// Byte where the region starts in its first row.
+        size_t x;
+
+        /// First row of the region.
+        size_t y;
+
+        /// Width of the region in bytes.
+        size_t width;
+
+        /// Number of rows of the region.
+        size_t height;
+
+        /// Size in bytes of each row of the buffer.
+        size_t rowPitch;
+
+        /// Size in bytes of each row in host memory, or 0 if the rows are
+        /// tightly packed.
+        size_t hostRowPitch;
+
+        /// Creates the region.
+        Rect(size_t x = 0, size_t y = 0, size_t width = 0, size_t height = 0,
+                size_t rowPitch = 0, size_t hostRowPitch = 0)
+            : x(x), y(y), width(width), height(height), rowPitch(rowPitch),
+            hostRowPitch(hostRowPitch) { }
+    };
+
     /**
      * Creates a memory buffer.
      * @param size The size in bytes of the buffer.
+     * @param allocation Where the memory of the buffer is allocated.
      */
-    Buffer(size_t size);
+    Buffer(size_t size, Allocation allocation = DeviceMemory);
 
     Buffer(const Buffer &) = delete;
     Buffer &operator=(const Buffer &) = delete;
@@ -119,6 +194,20 @@ public:
      */
     void setAndroidBitmapSource(JNIEnv *env, jobject bitmap);
 
+    /**
+     * Saves a direct java.nio.ByteBuffer with at least size() bytes to be used
+     * as the data source of the buffer. If the device shares memory with the
+     * host and the ByteBuffer's memory is aligned as the device requires, the
+     * device uses that memory directly instead of copying it, so the
+     * ByteBuffer must be kept alive while the buffer exists and kernels that
+     * write to the buffer write to the ByteBuffer too. Otherwise it only
+     * needs to be kept alive until the kernel executes, like a jarray.
+     * If there is already another source, it will be discarded and this will
+     * be set as the new source.
+     * Throws BufferCopyError if the ByteBuffer isn't direct or is too small.
+     */
+    void setDirectByteBufferSource(JNIEnv *env, jobject byteBuffer);
+
     /**
      * Saves the host pointer to copy  size() bytes to the internal memory.
      * Important: this function only saves the pointer to where the data is,
@@ -129,6 +218,18 @@ public:
      */
     void setSource(void *host);
 
+    /**
+     * Maps size() bytes of a file, starting at the given offset, to be used
+     * as the data source of the buffer. Like setSource(), the data is only
+     * copied when the buffer is first used. If the device shares memory with
+     * the host, the mapped pages are used directly by the device instead of
+     * being copied. The file itself is never written.
+     * If there is another source already, it will be discarded and this will
+     * be the new source.
+     * Throws BufferCopyError if the file can't be mapped or is too small.
+     */
+    void setFileSource(const std::string &path, size_t offset = 0);
+
     /**
      * Helper method to copy size() bytes to a jarray. Throws
      * EmptyBufferError if the buffer doesn't have any data.
@@ -141,12 +242,205 @@ public:
      */
     void copyToAndroidBitmap(JNIEnv *env, jobject bitmap);
 
+    /**
+     * Helper method to copy size() bytes to a direct java.nio.ByteBuffer. If
+     * the buffer uses the ByteBuffer's memory directly, it is only brought up
+     * to date. Throws BufferCopyError if the ByteBuffer isn't direct or is too
+     * small and BufferEmptyError if the buffer doesn't have any data.
+     */
+    void copyToDirectByteBuffer(JNIEnv *env, jobject byteBuffer);
+
     /**
      * Copies size() bytes to an host pointer. Throws
      * EmptyBufferError if the buffer doesn't have any data.
      */
     void copyTo(void *host);
 
+    /**
+     * Copies size() bytes to a file through a memory mapping of it. The file
+     * is created if it doesn't exist and truncated to size() bytes otherwise.
+     * Throws BufferCopyError if the file can't be mapped and
+     * BufferEmptyError if the buffer doesn't have any data.
+     */
+    void copyToFile(const std::string &path);
+
+    /**
+     * Enables or disables the host shadow of the buffer, which is shared with
+     * its views. While enabled, the buffer keeps a host copy of the data read
+     * by copyTo() and hostData(), and only reads the parts that devices wrote
+     * to since the last read again. Disabled by default, as it doubles the
+     * host memory used by the buffer.
+     */
+    void setHostShadow(bool enabled);
+
+    /**
+     * Returns a pointer to size() bytes with the up to date contents of the
+     * buffer, enabling the host shadow. Nothing is copied if no device wrote
+     * to the buffer since the last call. The pointer stays valid while the
+     * host shadow is enabled, but its contents are only updated by later calls.
+     * Throws BufferEmptyError if the buffer doesn't have any data.
+     */
+    const void *hostData();
+
+    /**
+     * Copies length bytes starting at the given offset of the buffer to an
+     * host pointer. Throws BufferCopyError if the range doesn't fit in the
+     * buffer and BufferEmptyError if the buffer doesn't have any data.
+     */
+    void copyTo(void *host, size_t offset, size_t length);
+
+    /**
+     * Copies a 2D region of the buffer to an host pointer, which receives
+     * the rows of the region spaced by rect.hostRowPitch bytes. Throws
+     * BufferCopyError if the region doesn't fit in the buffer and
+     * BufferEmptyError if the buffer doesn't have any data.
+     */
+    void copyTo(void *host, const Rect &rect);
+
+    /**
+     * Copies length bytes from an host pointer to the buffer, starting at the
+     * given offset. Unlike setSource(), the copy is made on the spot, to the
+     * device that used the buffer last, and the rest of the buffer is kept.
+     * Throws BufferCopyError if the range doesn't fit in the buffer and
+     * BufferEmptyError if no device used the buffer yet.
+     */
+    void copyFrom(const void *host, size_t offset, size_t length);
+
+    /**
+     * Copies a 2D region from an host pointer, which has the rows of the
+     * region spaced by rect.hostRowPitch bytes, to the buffer. The copy is
+     * made on the spot, like copyFrom() with a range. Throws BufferCopyError
+     * if the region doesn't fit in the buffer and BufferEmptyError if no
+     * device used the buffer yet.
+     */
+    void copyFrom(const void *host, const Rect &rect);
+
+    /**
+     * Copies length bytes starting at sourceOffset of another buffer to the
+     * given offset of this buffer. The copy is queued on the device that used
+     * this buffer last, or the source buffer if this one wasn't used yet,
+     * behind the work already queued for them, so the data doesn't go through
+     * the host if the source is on that device. The ranges may only overlap
+     * if they belong to different buffers.
+     * Throws BufferCopyError if the ranges don't fit or overlap and
+     * BufferEmptyError if the source buffer doesn't have any data.
+     */
+    void copyFrom(Buffer &source, size_t sourceOffset, size_t offset,
+            size_t length);
+
+    /**
+     * Copies all the contents of another buffer of the same size, like
+     * copyFrom() with ranges.
+     */
+    void copyFrom(Buffer &source);
+
+    /**
+     * Fills the buffer with copies of a pattern of patternSize bytes. The
+     * pattern is written once and replicated by device-side copies that
+     * double the filled part each time, so only patternSize bytes go through
+     * the host.
+     * @param device The device to fill the buffer on instead of the one that
+     * used the buffer last.
+     * Throws BufferCopyError if size() isn't a multiple of patternSize and
+     * BufferEmptyError if no device is given and no device used the buffer
+     * yet.
+     */
+    void fill(const void *pattern, size_t patternSize,
+            std::shared_ptr<Device> device = nullptr);
+
+    /**
+     * Fills the buffer with copies of the given value.
+     * @see fill
+     */
+    template<typename T>
+    void fill(const T &value, std::shared_ptr<Device> device = nullptr) {
+        fill(&value, sizeof(value), device);
+    }
+
+    /**
+     * Starts copying size() bytes to an host pointer and returns without
+     * waiting for the copy to finish. The copy waits for the kernels already
+     * queued on the device it reads from, but not for the ones queued after
+     * it, so reading back the results of a frame can overlap with the
+     * execution of the next. The host pointer must be kept alive until the
+     * returned event finishes. Kernels that use the buffer after this call
+     * wait for the copy.
+     * Throws BufferEmptyError if no device has the contents of the buffer.
+     */
+    std::shared_ptr<Event> copyToAsync(void *host);
+
+    /**
+     * Starts copying size() bytes from an host pointer to the memory object of
+     * the device that used the buffer last, invalidating the copies of other
+     * devices, and returns without waiting for the copy to finish. Unlike
+     * setSource(), the copy is queued right away instead of right before the
+     * next kernel. The host pointer must be kept alive until the returned
+     * event finishes. Kernels that use the buffer after this call wait for
+     * the copy.
+     * @param device The device to copy to instead of the one that used the
+     * buffer last.
+     * Throws BufferEmptyError if no device is given and no device used the
+     * buffer yet, in which case setSource() must be used.
+     */
+    std::shared_ptr<Event> setSourceAsync(void *host,
+            std::shared_ptr<Device> device = nullptr);
+
+    /**
+     * Brings the up to date contents of the buffer to the given device now,
+     * allocating its memory object if needed, instead of when a kernel of
+     * the device uses the buffer. The data is read from the other devices
+     * and written on the transfer queue of the device without waiting, so
+     * the migration overlaps with the kernels the device is running, and
+     * kernels that use the buffer after this call wait for it. Sources set
+     * with set*Source() are still copied on the spot. The other devices keep
+     * their copies.
+     * Throws BufferEmptyError if no device has the contents of the buffer
+     * and there is no source to copy from.
+     */
+    void prefetch(std::shared_ptr<Device> device);
+
+    /**
+     * Returns the devices that have an up to date copy of the whole buffer,
+     * which are the devices that can use it without a migration.
+     */
+    std::vector<std::shared_ptr<Device>> residentOn();
+
+    /**
+     * Maps the memory object of the device that used the buffer last to host
+     * memory and returns a pointer to its size() bytes, that can be read and
+     * written until unmap() is called.
+     * With HostVisibleMemory on a device with unified memory this makes no
+     * copies. The buffer is unmapped automatically when a kernel uses it.
+     * Throws BufferEmptyError if no device used the buffer yet.
+     */
+    void *map();
+
+    /**
+     * Unmaps the pointer returned by map(). Does nothing if the buffer isn't
+     * mapped.
+     */
+    void unmap();
+
+    /**
+     * Creates a buffer that shares length bytes of this buffer's memory,
+     * starting at the given offset, without allocating or copying anything.
+     * Kernels that use the view only access its part of the buffer, so views
+     * of disjoint parts can be used by tasks on different devices at the same
+     * time. The offset must be a multiple of Device::memBaseAddrAlign() of
+     * the devices that use the view.
+     * This buffer must be owned by a std::shared_ptr, and a copy source saved
+     * on the view is only copied when the view itself is used.
+     * Throws BufferConstructionError if the view doesn't fit in the buffer.
+     */
+    std::shared_ptr<Buffer> view(size_t offset, size_t length);
+
+    /**
+     * Returns where the memory of the buffer is allocated.
+     */
+    inline Allocation allocation() {
+        return _allocation;
+    }
+
     /**
      * Returns the size of the buffer in bytes.
      */
@@ -155,49 +449,321 @@ public:
     }
 
 private:
+    friend class Device;
     friend class Kernel;
+    friend class Task;
+
+    /// Byte ranges, mapping where each range begins to where it ends.
+    typedef std::map<size_t, size_t> Ranges;
+
+    /// Memory object of the root buffer and the view's sub-buffer created on it.
+    typedef std::pair<_cl_mem *, _cl_mem *> SubBuffer;
+
+    /**
+     * Copy of the buffer kept by a device. Coherence follows the MSI protocol
+     * applied to byte ranges: many devices can share up to date copies of a
+     * range, but a device that writes to it invalidates the range in the
+     * copies of the others.
+     */
+    struct Replica {
+        std::shared_ptr<Device> device;     /// Device of the copy.
+        _cl_mem *mem;                       /// Memory object of the copy.
+        uint64_t flags;                     /// cl_mem_flags of mem.
+        Ranges valid;                       /// Up to date ranges of the copy.
+        _cl_event *transferEvent;           /// Last asynchronous transfer.
+        unsigned lastTask;                  /// Last task of device to use it.
+    };
+
+    /**
+     * Creates a view of the given buffer.
+     */
+    Buffer(std::shared_ptr<Buffer> parent, size_t offset, size_t size);
 
     /**
-     * Returns the OpenCL memory object. Creates it if it wasn't created yet.
+     * Returns the buffer that owns the memory, which is the buffer itself if
+     * this isn't a view.
+     */
+    inline Buffer &root() {
+        return _parent ? *_parent : *this;
+    }
+
+    /**
+     * Returns the device that used the buffer last or, for a view that wasn't
+     * used yet, the device that used the root buffer last.
+     */
+    inline std::shared_ptr<Device> &lastDevice() {
+        return _device || !_parent ? _device : _parent->_device;
+    }
+
+    /**
+     * Returns the OpenCL memory object on the given device for a kernel that
+     * accesses the buffer as given. The up to date contents of the buffer are
+     * brought to the device first unless the access is WriteOnly, and the
+     * copies of the other devices are invalidated unless it is ReadOnly.
      * This should only be called by the Kernel class.
      */
-    _cl_mem *clMem(std::shared_ptr<Device> device);
+    _cl_mem *clMem(std::shared_ptr<Device> device, Access access = ReadWrite);
+
+    /**
+     * Like clMem(), for a kernel that only accesses the bytes from begin to
+     * end of the buffer because its range is split across devices. Only
+     * these bytes are brought to the device and invalidated on the others,
+     * so the devices keep the parts they wrote until the buffer is read.
+     */
+    _cl_mem *clMem(std::shared_ptr<Device> device, Access access, size_t begin,
+            size_t end);
+
+    /**
+     * Copies the pending sources of the buffer and of its root buffer to the
+     * given copy of the root buffer.
+     */
+    void flushSources(Replica &replica);
+
+    /**
+     * Returns the sub-buffer of a view on the memory object of the copy,
+     * creating it if it wasn't created yet.
+     */
+    _cl_mem *subBuffer(Replica &replica);
+
+    /**
+     * Returns the copy of the buffer on the given device, creating the memory
+     * object for the given access if it wasn't created yet.
+     */
+    Replica &replica(std::shared_ptr<Device> &device,
+            Access access = ReadWrite);
+
+    /**
+     * Replaces the memory object of the copy by one that kernels can read and
+     * write, copying the up to date ranges on the device.
+     */
+    void reallocate(Replica &replica);
+
+    /**
+     * Copies the parts of the range that the copy doesn't have up to date
+     * from the copies of the other devices.
+     */
+    void validate(Replica &replica, size_t begin, size_t end);
+
+    /**
+     * Like validate(), but writes the missing parts to the copy on the
+     * transfer queue of its device without waiting, and records the last
+     * write as the transfer of the copy. The parts are read to host blocks
+     * that are freed once written.
+     */
+    void prefetchRanges(Replica &replica, size_t begin, size_t end);
+
+    /**
+     * Marks the range as up to date in the given copy and as outdated in the
+     * copies of the other devices.
+     */
+    void markWritten(Replica &replica, size_t begin, size_t end);
+
+    /**
+     * Marks the range of the host copy as outdated, freeing it if nothing
+     * else is up to date and the host shadow is disabled.
+     */
+    void invalidateHost(size_t begin, size_t end);
+
+    /**
+     * Called by the kernels after enqueueing a command that writes the range
+     * of the buffer, as the host shadow may have read it since the buffer
+     * was set as their argument. The reads after this are queued behind the
+     * kernel.
+     */
+    void kernelWrote(size_t begin, size_t end);
+
+    /**
+     * Returns a copy with the whole range up to date, preferring the copy of
+     * the given device, or nullptr if no device has any part of the range.
+     */
+    Replica *readReplica(size_t begin, size_t end,
+            std::shared_ptr<Device> &preferred);
+
+    /**
+     * Returns the range of the buffer spanned by the region, relative to the
+     * root buffer. Throws BufferCopyError if the region doesn't fit.
+     */
+    std::pair<size_t, size_t> rectSpan(const Rect &rect);
+
+    /**
+     * Copies the range from one copy of the buffer to another.
+     */
+    void copyRange(Replica &from, Replica &to, size_t begin, size_t end);
+
+    /// Adds the range to the set of ranges.
+    static void addRange(Ranges &ranges, size_t begin, size_t end);
+
+    /// Removes the range from the set of ranges.
+    static void removeRange(Ranges &ranges, size_t begin, size_t end);
+
+    /// Returns the parts of the range that are not in the set of ranges.
+    static Ranges missingRanges(const Ranges &ranges, size_t begin,
+            size_t end);
+
+    /**
+     * Allocates a memory object for the buffer on the given device that
+     * kernels can access as given, returning the cl_mem_flags it was created
+     * with in flags.
+     */
+    _cl_mem *allocate(std::shared_ptr<Device> &device, Access access,
+            uint64_t &flags);
+
+    /**
+     * Returns if kernels can access a memory object created with the given
+     * cl_mem_flags as given.
+     */
+    static bool allowsAccess(uint64_t flags, Access access);
+
+    /**
+     * Gives back a memory object returned by allocate().
+     */
+    void deallocate(_cl_mem *mem, uint64_t flags,
+            std::shared_ptr<Device> &device);
+
+    /**
+     * Returns if the copy of the given device can be evicted. Copies used by
+     * the task running on the device, of buffers pinned by queued tasks, or
+     * that are mapped or use host memory aren't evicted. The buffer's mutex
+     * must be locked.
+     */
+    bool evictable(Device &device);
+
+    /**
+     * Moves the copy of the given device to host memory and frees its memory
+     * object, returning if it did, after the transfers that use the copy
+     * finish. The buffer's mutex must be locked and the copy evictable. Only
+     * the Device class calls this, when it is over its memory budget.
+     */
+    bool evict(Device &device);
+
+    /**
+     * Keeps the devices from evicting the buffer until unpin() is called as
+     * many times. Only the Task class should call this.
+     */
+    inline void pin() {
+        ++root()._pins;
+    }
+
+    /// Undoes a call to pin().
+    inline void unpin() {
+        --root()._pins;
+    }
+
+    /**
+     * Copies the missing parts of the range from the host copy of the evicted
+     * data to the given copy.
+     */
+    void restore(Replica &replica, size_t begin, size_t end);
 
     /**
-     * Creates an OpenCL memory object on the given device or makes a copy to
-     * a memory object on the new device if one already exists and the flag
-     * is set.
+     * Reads the parts of the range that the host copy is missing from a copy
+     * that has them, preferring the copy of the given device. Throws
+     * BufferEmptyError if no device has the contents of the buffer.
      */
-    void createMemoryObject(std::shared_ptr<Device> newDevice, bool copyOld);
+    void updateShadow(size_t begin, size_t end,
+            std::shared_ptr<Device> &preferred);
 
     /**
-     * Release the copy structures before creating a new copy source.
+     * Makes the device of the copy wait for its last asynchronous transfer
+     * before executing the commands queued after this call.
+     */
+    void waitTransfer(Replica &replica);
+
+    /**
+     * Enqueues a marker on the compute queue of the copy's device so that
+     * asynchronous transfers can wait for the commands queued before it.
+     * The queue is flushed so that waits from other queues make progress.
+     */
+    _cl_event *computeMarker(Replica &replica);
+
+    /**
+     * Creates the memory object of a copy directly over the memory of the file
+     * or direct ByteBuffer source when the device shares memory with the host
+     * and the memory is aligned as the device requires, handing it over to the
+     * memory object, which keeps the ByteBuffer referenced until it is
+     * destroyed. Returns nullptr if the source can't be used.
+     */
+    _cl_mem *adoptHostSource(std::shared_ptr<Device> &device, uint64_t &flags);
+
+    /**
+     * Returns the address of a direct ByteBuffer. Throws BufferCopyError if
+     * the ByteBuffer isn't direct or is smaller than the buffer.
+     */
+    void *directByteBufferAddress(JNIEnv *env, jobject byteBuffer);
+
+    /**
+     * Unmaps the file source.
+     */
+    void releaseFileSource();
+
+    /**
+     * Release the copy structures before creating a new copy source. The
+     * env must belong to the calling thread.
      */
     void releaseCopySources(JNIEnv *env);
 
+    /**
+     * Like releaseCopySources(JNIEnv *), with the JNIEnv of the calling
+     * thread, for functions that aren't given one.
+     */
+    void releaseCopySources();
+
     /**
      * If has copy sources.
      */
     inline bool hasCopySource() {
-        return _copyPtr || _copyArray || _copyBitmap;
+        return _copyPtr || _copyFile.address || _copyDirect || _copyArray
+            || _copyBitmap;
     }
 
     /**
-     * Properly makes the copies to the _mem structure.
+     * Properly makes the copies to the given copy of the root buffer. Java
+     * sources are accessed through the JNIEnv of the calling thread.
+     */
+    void makeCopy(Replica &replica);
+
+    /**
+     * Properly makes the copy from the pointer to the given copy of the root
+     * buffer.
+     */
+    void makeCopyFrom(void *host, Replica &replica);
+
+    /**
+     * Copies the data written by fill to the staging ring of the copy's
+     * device, which then copies it to the copy without blocking the host.
      */
-    void makeCopy(JNIEnv *env);
+    void stageCopy(const std::function<void (void *)> &fill, Replica &replica);
 
     /**
-     * Properly makes the copy from the pointer to the _mem structure.
+     * Memory mapping of a file.
      */
-    void makeCopyFrom(void *host);
+    struct FileMapping {
+        void *address;  /// Start of the mapping, nullptr if not mapped.
+        size_t length;  /// Length of the mapping.
+        void *data;     /// First byte of the mapped data.
+    };
 
     size_t _size;                       /// Size of the buffer.
-    _cl_mem *_mem;                      /// Pointer to the buffer.
-    std::shared_ptr<Device> _device;    /// Device of the buffer.
+    Allocation _allocation;             /// Where the memory is allocated.
+    std::shared_ptr<Buffer> _parent;    /// Buffer that owns a view's memory.
+    size_t _offset;                     /// Offset of a view in _parent.
+    std::map<unsigned, Replica> _replicas; /// Copies by device ID.
+    std::map<unsigned, SubBuffer> _subBuffers; /// View's sub-buffers by ID.
+    std::vector<std::weak_ptr<Buffer>> _views; /// Views created on the buffer.
+    void *_hostCopy;                    /// Evicted data and host shadow.
+    Ranges _hostValid;                  /// Up to date ranges of _hostCopy.
+    bool _hostShadow;                   /// If reads keep _hostCopy updated.
+    std::shared_ptr<Device> _device;    /// Device that used the buffer last.
+    void *_mapped;                      /// Pointer returned by map().
     void *_copyPtr;                     /// Pointer with the data to be copied.
+    FileMapping _copyFile;              /// File to be copied.
+    void *_copyDirect;                  /// Direct ByteBuffer to be copied.
+    jobject _copyDirectRef;             /// Global ref of the ByteBuffer.
     jarray _copyArray;                  /// Array to be copied.
     jobject _copyBitmap;                /// Bitmap to be copied.
+    JavaVM *_vm;                        /// VM of the Java sources.
+    std::recursive_mutex _mutex;        /// Guards the buffer and its views.
+    std::atomic<unsigned> _pins;        /// Queued tasks that use the buffer.
 };
 
 }
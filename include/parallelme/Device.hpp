@@ -9,8 +9,13 @@
 #ifndef PARALLELME_DEVICE_HPP
 #define PARALLELME_DEVICE_HPP
 
+#include <atomic>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
+#include <unordered_map>
+#include <vector>
 #include <jni.h>
 
 struct _cl_device_id;
@@ -19,6 +24,9 @@ struct _cl_command_queue;
 
 namespace parallelme {
 
+class Buffer;
+class MemoryPool;
+class StagingRing;
 class Worker;
 
 /**
@@ -83,6 +91,30 @@ public:
         return _id;
     }
 
+    /**
+     * Returns if the device shares its memory with the host, in which case
+     * memory objects created from host memory are accessed without copies.
+     */
+    inline bool hostUnifiedMemory() const {
+        return _hostUnifiedMemory;
+    }
+
+    /**
+     * Returns the alignment in bytes required by the device for the host
+     * memory used by its memory objects.
+     */
+    inline size_t memBaseAddrAlign() const {
+        return _memBaseAddrAlign;
+    }
+
+    /**
+     * Returns if the device executes native kernels, which are C++ functions
+     * run by the host threads of the device's implementation.
+     */
+    inline bool nativeKernels() const {
+        return _nativeKernels;
+    }
+
     /**
      * Returns the JNIEnv of the device's thread.
      */
@@ -110,9 +142,142 @@ public:
          return _clQueue;
     }
 
+    /**
+     * Returns the cl_command_queue used by asynchronous transfers, so they can
+     * overlap with the kernels queued in clQueue().
+     */
+    inline _cl_command_queue *clTransferQueue() {
+         return _clTransferQueue;
+    }
+
+    /**
+     * Returns the pool that caches the memory objects of this device.
+     */
+    inline MemoryPool &memoryPool() {
+        return *_memoryPool;
+    }
+
+    /**
+     * Sets how many bytes the buffers can keep on the device. When a buffer
+     * needs more memory than the budget allows, the least recently used
+     * buffers that aren't used by the task running on the device are moved
+     * to host memory, and brought back when they are used again.
+     * Defaults to the global memory size of the device.
+     */
+    void setMemoryBudget(size_t bytes);
+
+    /// Returns how many bytes the buffers can keep on the device.
+    size_t memoryBudget();
+
+    /// Returns how many bytes the buffers and staging slots keep on the
+    /// device.
+    size_t memoryInUse();
+
 private:
+    friend class Buffer;
+    friend class StagingRing;
     friend class Worker;
 
+    /**
+     * Memory kept on the device by a buffer.
+     */
+    struct MemoryUse {
+        std::list<Buffer *>::iterator position; /// Position in _lru.
+        size_t bytes;                           /// Bytes used.
+    };
+
+    /**
+     * Returns the ring of pinned memory used to upload Java data to the
+     * device. Only the Buffer class should call this.
+     */
+    inline StagingRing &stagingRing() {
+        return *_stagingRing;
+    }
+
+    /**
+     * Accounts size bytes of memory to the buffer, marking it as the most
+     * recently used. Other buffers are evicted first if the budget would be
+     * exceeded. Only the Buffer class should call this.
+     */
+    void reserveMemory(Buffer *buffer, size_t size);
+
+    /**
+     * Removes size bytes of memory from the buffer's account. Only the Buffer
+     * class should call this.
+     */
+    void releaseMemory(Buffer *buffer, size_t size);
+
+    /**
+     * Accounts size bytes of memory that no buffer owns, evicting buffers
+     * other than exclude first if the budget would be exceeded. Only the
+     * StagingRing class should call this.
+     */
+    void reserveMemory(size_t size, Buffer *exclude);
+
+    /**
+     * Removes size bytes of memory that no buffer owns from the account.
+     * Only the StagingRing class should call this.
+     */
+    void releaseMemory(size_t size);
+
+    /**
+     * Marks the buffer as the most recently used. Only the Buffer class
+     * should call this.
+     */
+    void touchMemory(Buffer *buffer);
+
+    /**
+     * Evicts all the buffers that can be evicted but the given one, to make
+     * room for it when the device is out of memory. Only the Buffer class
+     * should call this.
+     */
+    void reclaimMemory(Buffer *buffer);
+
+    /**
+     * Buffer taken out of the accounting to be evicted.
+     */
+    struct Victim {
+        Buffer *buffer;                             /// Buffer to evict.
+        std::unique_lock<std::recursive_mutex> lock; /// Lock of the buffer.
+        size_t bytes;                               /// Bytes it used.
+    };
+
+    /**
+     * Accounts size bytes of memory to the buffer, marking it as the most
+     * recently used if recent is true, or adding it as the least recently
+     * used otherwise. _memoryMutex must be locked.
+     */
+    void accountMemory(Buffer *buffer, size_t size, bool recent);
+
+    /**
+     * Takes the least recently used buffers that can be evicted, but the
+     * given one, out of the accounting until the memory in use is at most
+     * maxBytes, and locks them. _memoryMutex must be locked.
+     */
+    std::vector<Victim> pickVictims(Buffer *buffer, size_t maxBytes);
+
+    /**
+     * Evicts the buffers taken by pickVictims(). Called without _memoryMutex,
+     * so that copying them to the host doesn't block the allocations of
+     * other threads. Buffers that fail to be evicted are accounted again.
+     */
+    void evictVictims(std::vector<Victim> &victims);
+
+    /**
+     * Returns the number of the task running on the device. The buffers used
+     * by it can't be evicted.
+     */
+    inline unsigned currentTask() {
+        return _currentTask;
+    }
+
+    /**
+     * Starts a new task. Only the Worker class should call this.
+     */
+    inline void beginTask() {
+        ++_currentTask;
+    }
+
     /**
      * Sets the JNIEnv of the device. Only the Worker class should call this.
      */
@@ -132,9 +297,21 @@ private:
     _cl_device_id *_clDevice;       /// OpenCL Device ID.
     _cl_context *_clContext;        /// OpenCL context.
     _cl_command_queue *_clQueue;    /// OpenCL command queue.
+    _cl_command_queue *_clTransferQueue; /// Queue of asynchronous transfers.
+    std::unique_ptr<MemoryPool> _memoryPool; /// Memory object cache.
+    std::unique_ptr<StagingRing> _stagingRing; /// Pinned upload memory.
     Type _type;                     /// The type of this device.
+    bool _hostUnifiedMemory;        /// If memory is shared with the host.
+    size_t _memBaseAddrAlign;       /// Host memory alignment in bytes.
+    bool _nativeKernels;            /// If native kernels are supported.
     unsigned _id;                   /// Device ID.
     _JNIEnv *_env;                   /// JNIEnv of the device's thread.
+    size_t _memoryBudget;           /// Bytes the buffers can use.
+    size_t _memoryInUse;            /// Bytes the buffers and slots use.
+    std::list<Buffer *> _lru;       /// Buffers, least recently used first.
+    std::unordered_map<Buffer *, MemoryUse> _memoryUse; /// Use of each buffer.
+    std::atomic<unsigned> _currentTask; /// Number of the running task.
+    std::mutex _memoryMutex;        /// Guards the memory accounting.
 };
 
 }
@@ -0,0 +1,71 @@
+/*                                                _    __ ____
+ *   _ __  ___ _____   ___   __  __   ___ __     / |  / /  __/
+ *  |  _ \/ _ |  _  | / _ | / / / /  / __/ /    /  | / / /__
+ *  |  __/ __ |  ___|/ __ |/ /_/ /__/ __/ /__  / / v  / /__
+ *  |_| /_/ |_|_|\_\/_/ |_/____/___/___/____/ /_/  /_/____/
+ *
+ */
+
+#ifndef PARALLELME_EVENT_HPP
+#define PARALLELME_EVENT_HPP
+
+#include <stdexcept>
+
+struct _cl_event;
+
+namespace parallelme {
+class Buffer;
+
+/**
+ * Exception thrown if the operation tracked by an event failed or if the event
+ * couldn't be queried.
+ * The error message can be accessed through the what() function.
+ */
+class EventError : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+/**
+ * Handle to an operation that was queued to execute asynchronously, like the
+ * transfers started by Buffer::copyToAsync() and Buffer::setSourceAsync().
+ *
+ * @author Renato Utsch
+ */
+class Event {
+    friend class Buffer;
+
+    /**
+     * Constructs the event, taking ownership of the given cl_event.
+     * Only the classes that start asynchronous operations can do it.
+     */
+    Event(_cl_event *event);
+
+public:
+    Event(const Event &) = delete;
+    Event &operator=(const Event &) = delete;
+
+    ~Event();
+
+    /**
+     * Blocks until the operation finishes. Throws EventError if it failed.
+     */
+    void wait();
+
+    /**
+     * Returns if the operation already finished, without blocking. Throws
+     * EventError if it failed.
+     */
+    bool finished();
+
+    /// Returns the cl_event.
+    inline _cl_event *clEvent() {
+        return _clEvent;
+    }
+
+private:
+    _cl_event *_clEvent;
+};
+
+}
+
+#endif // !PARALLELME_EVENT_HPP
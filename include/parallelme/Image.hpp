@@ -0,0 +1,197 @@
+/*                                                _    __ ____
+ *   _ __  ___ _____   ___   __  __   ___ __     / |  / /  __/
+ *  |  _ \/ _ |  _  | / _ | / / / /  / __/ /    /  | / / /__
+ *  |  __/ __ |  ___|/ __ |/ /_/ /__/ __/ /__  / / v  / /__
+ *  |_| /_/ |_|_|\_\/_/ |_/____/___/___/____/ /_/  /_/____/
+ *
+ */
+
+#ifndef PARALLELME_IMAGE_HPP
+#define PARALLELME_IMAGE_HPP
+
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <jni.h>
+
+struct _cl_mem;
+
+namespace parallelme {
+class Device;
+class Kernel;
+
+/**
+ * Exception thrown if the image failed to be created.
+ * The error message can be accessed through the what() function.
+ */
+class ImageConstructionError : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+/**
+ * Exception thrown if the image failed to copy data.
+ * The error message can be accessed through the what() function.
+ */
+class ImageCopyError : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+/**
+ * Exception thrown if the image is empty when trying to copy its data.
+ * The error message can be accessed through the what() function.
+ */
+class ImageEmptyError : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+/**
+ * Two-dimensional RGBA image stored in OpenCL image objects.
+ *
+ * Kernels read images through samplers, which go through the texture cache
+ * and can filter and clamp in hardware, so they suit convolution and
+ * resampling filters better than a Buffer with the same pixels.
+ *
+ * The image keeps one image object per device. Only the device that used
+ * the image last has its newest contents, which are copied to another
+ * device when a kernel of that device uses it.
+ *
+ * @author Renato Utsch
+ */
+class Image {
+    friend class Kernel;
+
+public:
+    /**
+     * Format of the pixels of the image. Each pixel has four channels, in
+     * the RGBA order.
+     */
+    enum Format {
+        /// Each channel is an unsigned byte, read as a float in [0, 1].
+        RGBA8,
+
+        /// Each channel is a float.
+        RGBAFloat
+    };
+
+    /**
+     * Creates an image.
+     * @param width The width of the image in pixels.
+     * @param height The height of the image in pixels.
+     * @param format The format of the pixels.
+     */
+    Image(size_t width, size_t height, Format format = RGBA8);
+    Image(const Image &) = delete;
+    Image &operator=(const Image &) = delete;
+
+    ~Image();
+
+    /**
+     * Saves the bitmap to be used as the data source when the image is
+     * first used by a kernel. Only RGBA8 images can use bitmaps, which must
+     * have the same size as the image and the ARGB_8888 format.
+     * This function does not change the bitmap.
+     */
+    void setAndroidBitmapSource(JNIEnv *env, jobject bitmap);
+
+    /**
+     * Saves the pointer to be used as the data source when the image is
+     * first used by a kernel. The pointer must have the rows of the image
+     * tightly packed and remain valid until then.
+     * This function does not change the memory pointed by host.
+     */
+    void setSource(void *host);
+
+    /**
+     * Helper method to copy the image to an Android bitmap. The image must be
+     * RGBA8 and the bitmap must have its size and the ARGB_8888 format.
+     * Throws ImageEmptyError if the image doesn't have any data.
+     */
+    void copyToAndroidBitmap(JNIEnv *env, jobject bitmap);
+
+    /**
+     * Copies the image to an host pointer, with the rows tightly packed.
+     * Throws ImageEmptyError if the image doesn't have any data.
+     */
+    void copyTo(void *host);
+
+    /// Returns the width of the image in pixels.
+    inline size_t width() const {
+        return _width;
+    }
+
+    /// Returns the height of the image in pixels.
+    inline size_t height() const {
+        return _height;
+    }
+
+    /// Returns the format of the pixels.
+    inline Format format() const {
+        return _format;
+    }
+
+    /// Returns the size in bytes of each pixel.
+    inline size_t pixelSize() const {
+        return _format == RGBAFloat ? 4 * sizeof(float) : 4;
+    }
+
+    /// Returns the size in bytes of the image.
+    inline size_t size() const {
+        return _width * _height * pixelSize();
+    }
+
+private:
+    /**
+     * Returns the image object of the given device, with the newest contents
+     * of the image. A kernel of the device may write it, so the device is
+     * considered to have the newest contents afterwards.
+     */
+    _cl_mem *clMem(std::shared_ptr<Device> device);
+
+    /**
+     * Returns the image object of the device, creating it if needed.
+     */
+    _cl_mem *deviceImage(std::shared_ptr<Device> &device);
+
+    /**
+     * Copies the pending source of the image to the image of the device.
+     */
+    void flushSource(std::shared_ptr<Device> &device);
+
+    /**
+     * Writes an host region, with rows spaced by rowPitch bytes, to the
+     * image of the device.
+     */
+    void write(std::shared_ptr<Device> &device, const void *host,
+            size_t rowPitch);
+
+    /**
+     * Reads the image of the device to an host region, with rows spaced by
+     * rowPitch bytes.
+     */
+    void read(std::shared_ptr<Device> &device, void *host, size_t rowPitch);
+
+    /**
+     * Releases the copy sources.
+     */
+    void releaseCopySources(JNIEnv *env);
+
+    /// Returns if the image has a source that still needs to be copied.
+    inline bool hasCopySource() {
+        return _copyPtr || _copyBitmap;
+    }
+
+    size_t _width, _height;
+    Format _format;
+    std::map<unsigned, _cl_mem *> _images; /// Image object of each device id.
+    std::shared_ptr<Device> _device; /// Device with the newest contents.
+    void *_copyPtr;
+    jobject _copyBitmap;
+    JavaVM *_vm;                    /// VM of the bitmap source.
+    std::mutex _mutex;
+};
+
+}
+
+#endif // !PARALLELME_IMAGE_HPP
@@ -10,15 +10,21 @@
 #define PARALLELME_KERNEL_HPP
 
 #include <cstdlib>
+#include <functional>
+#include <map>
 #include <string>
 #include <stdexcept>
+#include <utility>
+#include <vector>
+#include "Buffer.hpp"
+#include "Program.hpp"
 
 struct _cl_kernel;
 
 namespace parallelme {
-class Buffer;
 class Device;
-class Program;
+class Image;
+class KernelArgs;
 class Task;
 
 /**
@@ -58,13 +64,40 @@ class Kernel {
      */
     void run();
 
+    /**
+     * Makes the kernel only execute the part of its range from begin to end,
+     * given as fractions of the last dimension of the work size that has
+     * more than one item, because the rest is executed by other devices.
+     * The buffers the kernel writes are then only bound in run(), when the
+     * bytes of the part are known.
+     */
+    void setPart(double begin, double end);
+
+    /**
+     * Returns the first and one past the last item of the split dimension,
+     * which has the given size, executed by the part. They are rounded to
+     * multiples of SplitGranularity.
+     */
+    std::pair<size_t, size_t> partRange(size_t size);
+
     /**
      * Constructs the Kernel object. Only the Task class can do it.
      * To create a kernel to be used with a task, call the Task::addKernel()
      * function.
+     * The OpenCL kernel is taken from the program's cache and only created if
+     * the cached ones are being used by other tasks.
      * @see Task::addKernel
      */
-    Kernel(const std::string &name, std::shared_ptr<Device> device, Program &program);
+    Kernel(const std::string &name, std::shared_ptr<Device> device,
+            std::shared_ptr<Program> program);
+
+    /**
+     * Constructs a native kernel, which executes the function with the host
+     * addresses of its arguments. Only the Task class can do it.
+     * @see Task::addNativeKernel
+     */
+    Kernel(const std::string &name, std::shared_ptr<Device> device,
+            std::function<void (void **)> function);
 
 public:
     Kernel(const Kernel &) = delete;
@@ -82,6 +115,27 @@ public:
         _xDim = xDim;
         _yDim = yDim;
         _zDim = zDim;
+        _padded = false;
+
+        return this;
+    }
+
+    /**
+     * Sets the range of execution, letting the runtime round it up to sizes
+     * the device runs faster: the x dimension to a multiple of the preferred
+     * work-group size multiple of the kernel and the y dimension to a
+     * multiple of PaddingHeight. The kernel must declare PM_WORK_SIZE as its
+     * last argument, which the runtime sets to the sizes given here, and
+     * skip the padding items with PM_IN_RANGE().
+     * @param xDim The number of items in the x dimension.
+     * @param yDim The number of items in the y dimension.
+     * @param zDim The number of items in the z dimension.
+     * @see Program
+     */
+    inline Kernel *setPaddedWorkSize(size_t xDim, size_t yDim = 1,
+            size_t zDim = 1) {
+        setWorkSize(xDim, yDim, zDim);
+        _padded = true;
 
         return this;
     }
@@ -89,8 +143,37 @@ public:
     /**
      * Sets a buffer as the argument with the given id.
      * Must only be called inside a ConfigFunction.
+     * @param access How the kernel accesses the buffer. Declaring it lets the
+     * runtime skip copying the old contents of WriteOnly buffers and keep the
+     * copies of ReadOnly buffers on other devices up to date. A WriteOnly
+     * buffer must be completely overwritten by the kernel.
+     * If the task is co-executed, each part of the range must only access
+     * its own slice of the buffers it writes, which are laid out along the
+     * split dimension.
+     * @see Task::setCoExecution
+     */
+    Kernel *setArg(unsigned id, std::shared_ptr<Buffer> buffer,
+            Buffer::Access access = Buffer::ReadWrite);
+
+    /**
+     * Sets an image as the argument with the given id. The kernel receives
+     * it as an image2d_t and reads it through a sampler.
+     * Must only be called inside a ConfigFunction.
      */
-    Kernel *setArg(unsigned id, std::shared_ptr<Buffer> buffer);
+    Kernel *setArg(unsigned id, std::shared_ptr<Image> image);
+
+    /**
+     * Sets all the arguments of the kernel from a pack. The first time a pack
+     * is set to the OpenCL kernel it is checked to set all of its arguments,
+     * and arguments whose values didn't change since they were last set to
+     * the OpenCL kernel, even by another task, aren't set again.
+     * The pack may only leave out the last argument if the kernel runs with
+     * setPaddedWorkSize(), which sets it.
+     * Must only be called inside a ConfigFunction.
+     * Throws KernelArgError if the pack doesn't match the kernel, or when
+     * the kernel runs if it left out the last argument without padding.
+     */
+    Kernel *setArgs(std::shared_ptr<const KernelArgs> args);
 
     /**
      * Sets a primitive type as the argument with the given id.
@@ -122,11 +205,89 @@ private:
      * Sets a PRIMITIVE type as the argument to the kernel. Trying to use this
      * function with other types will cause a segfault.
      */
-    Kernel *setPrimitiveArg(unsigned id, size_t size, void *host);
+    Kernel *setPrimitiveArg(unsigned id, size_t size, const void *host);
+
+    /**
+     * Sets the argument with the given id unless it is a primitive that
+     * already has the given bytes. Memory objects are always set, as they
+     * aren't retained by the cache.
+     * Returns the OpenCL error code.
+     */
+    int bindArg(unsigned id, size_t size, const void *value, bool isMem);
+
+    /// Items of the split dimension that each part is rounded to.
+    static const size_t SplitGranularity = 16;
+
+    /// Multiple the y dimension of a padded work size is rounded to.
+    static const size_t PaddingHeight = 8;
+
+    /**
+     * Rounds the work size up as set by setPaddedWorkSize() and sets the
+     * hidden argument with the sizes before rounding.
+     */
+    void padWorkSize(size_t workSize[3]);
+
+    /**
+     * Buffer argument of a kernel whose range is split across devices.
+     */
+    struct BufferArg {
+        unsigned id;
+        std::shared_ptr<Buffer> buffer;
+        Buffer::Access access;
+    };
+
+    /**
+     * Binds the buffer arguments of the part, whose items of the split
+     * dimension go from begin to end.
+     */
+    void setPartArgs(size_t begin, size_t end, size_t size);
+
+    /**
+     * Bytes of a buffer argument that the kernel writes.
+     */
+    struct WrittenRange {
+        std::shared_ptr<Buffer> buffer;
+        size_t begin, end;
+    };
+
+    /**
+     * Records the bytes of the buffer bound to the argument that the kernel
+     * writes, or that it writes none if access is ReadOnly.
+     */
+    void setWrites(unsigned id, std::shared_ptr<Buffer> &buffer,
+            Buffer::Access access, size_t begin, size_t end);
+
+    /**
+     * Tells the buffers the kernel writes that it was enqueued.
+     */
+    void notifyWrites();
+
+    /**
+     * Enqueues the function of a native kernel.
+     */
+    void runNative();
+
+    /**
+     * Argument of a native kernel.
+     */
+    struct NativeArg {
+        _cl_mem *mem;                   /// Memory object, or nullptr.
+        std::string value;              /// Bytes of a primitive.
+    };
 
+    std::string _name;
     std::shared_ptr<Device> _device;
-    _cl_kernel *_clKernel;
+    std::shared_ptr<Program> _program;  /// Cache the kernel goes back to.
+    Program::CachedKernel _cached;      /// Kernel and its arguments.
     size_t _xDim, _yDim, _zDim;
+    bool _padded;                       /// If setPaddedWorkSize() was called.
+    bool _lastArgUnset;                 /// If setArgs() left it for padding.
+    bool _split;                        /// If setPart() was called.
+    double _partBegin, _partEnd;        /// Part of the split dimension.
+    std::vector<BufferArg> _bufferArgs; /// Buffers bound by run() if split.
+    std::map<unsigned, WrittenRange> _writes; /// Written buffers by id.
+    std::function<void (void **)> _native; /// Function of a native kernel.
+    std::vector<NativeArg> _nativeArgs; /// Arguments of a native kernel.
 };
 
 }
@@ -0,0 +1,87 @@
+/*                                                _    __ ____
+ *   _ __  ___ _____   ___   __  __   ___ __     / |  / /  __/
+ *  |  _ \/ _ |  _  | / _ | / / / /  / __/ /    /  | / / /__
+ *  |  __/ __ |  ___|/ __ |/ /_/ /__/ __/ /__  / / v  / /__
+ *  |_| /_/ |_|_|\_\/_/ |_/____/___/___/____/ /_/  /_/____/
+ *
+ */
+
+#ifndef PARALLELME_KERNELARGS_HPP
+#define PARALLELME_KERNELARGS_HPP
+
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "Buffer.hpp"
+
+namespace parallelme {
+class Kernel;
+
+/**
+ * Immutable pack with all the arguments of a kernel, built once and set to
+ * the kernel of each execution with Kernel::setArgs(). The pack is checked
+ * against each kernel object only the first time it is set to it, and the
+ * primitives are only set again if their values differ from the ones last
+ * set to the kernel object, so tasks that run often with the same arguments
+ * skip most of the work of setting them.
+ *
+ * @author Renato Utsch
+ */
+class KernelArgs {
+    /**
+     * Argument of the pack.
+     */
+    struct Arg {
+        unsigned id;                        /// Index of the argument.
+        std::shared_ptr<Buffer> buffer;     /// Buffer, or nullptr.
+        Buffer::Access access;              /// How the buffer is accessed.
+        std::string value;                  /// Bytes of a primitive.
+    };
+
+public:
+    /**
+     * Builds a pack of arguments.
+     */
+    class Builder {
+    public:
+        /**
+         * Sets a buffer as the argument with the given id.
+         * @see Kernel::setArg
+         */
+        Builder &setArg(unsigned id, std::shared_ptr<Buffer> buffer,
+                Buffer::Access access = Buffer::ReadWrite);
+
+        /**
+         * Sets a primitive type as the argument with the given id.
+         * @see Kernel::setArg
+         */
+        template<typename T>
+        Builder &setArg(unsigned id, T primitive) {
+            return setPrimitiveArg(id, sizeof(primitive), &primitive);
+        }
+
+        /**
+         * Returns the pack with the arguments set so far.
+         */
+        std::shared_ptr<const KernelArgs> build();
+
+    private:
+        /// Sets the bytes of a PRIMITIVE type as the argument.
+        Builder &setPrimitiveArg(unsigned id, size_t size, const void *host);
+
+        std::map<unsigned, Arg> _args;      /// Arguments by id.
+    };
+
+private:
+    friend class Kernel;
+
+    KernelArgs() = default;
+
+    std::vector<Arg> _args;                 /// Arguments sorted by id.
+};
+
+}
+
+#endif // !PARALLELME_KERNELARGS_HPP
@@ -0,0 +1,176 @@
+/*                                                _    __ ____
+ *   _ __  ___ _____   ___   __  __   ___ __     / |  / /  __/
+ *  |  _ \/ _ |  _  | / _ | / / / /  / __/ /    /  | / / /__
+ *  |  __/ __ |  ___|/ __ |/ /_/ /__/ __/ /__  / / v  / /__
+ *  |_| /_/ |_|_|\_\/_/ |_/____/___/___/____/ /_/  /_/____/
+ *
+ */
+
+#ifndef PARALLELME_MEMORYARENA_HPP
+#define PARALLELME_MEMORYARENA_HPP
+
+#include <cstdint>
+#include <cstdlib>
+#include <list>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+struct _cl_context;
+struct _cl_mem;
+
+namespace parallelme {
+
+/**
+ * Exception thrown if the memory arena failed to allocate a memory object.
+ * The error message can be accessed through the what() function.
+ */
+class MemoryArenaError : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+/**
+ * Hands out small memory objects as sub-buffers of large blocks reserved from
+ * the driver, so that small buffers don't pay for a driver allocation each.
+ * Each block is managed by a buddy allocator: pieces have power of two sizes,
+ * starting at the device's base address alignment, and a freed piece is
+ * merged with its buddy whenever the buddy is free too.
+ * This class is thread-safe.
+ *
+ * @author Renato Utsch
+ */
+class MemoryArena {
+public:
+    /// Size of the blocks reserved from the driver.
+    static const size_t BlockSize = 1024 * 1024;
+
+    /// Largest size served by the arena.
+    static const size_t MaxAllocationSize = 64 * 1024;
+
+    /**
+     * Usage and fragmentation of the arena.
+     */
+    struct Statistics {
+        /// Bytes of the blocks reserved from the driver.
+        size_t reservedBytes;
+
+        /// Bytes of the pieces handed out, rounded up to their sizes.
+        size_t allocatedBytes;
+
+        /// Bytes requested by the pieces handed out.
+        size_t requestedBytes;
+
+        /// Size of the largest free piece.
+        size_t largestFreeBytes;
+
+        /// Number of pieces handed out.
+        size_t allocations;
+
+        /**
+         * Returns the fraction of the free bytes that are outside the largest
+         * free piece.
+         */
+        inline float externalFragmentation() const {
+            size_t freeBytes = reservedBytes - allocatedBytes;
+            return freeBytes ? 1.0f - (float) largestFreeBytes / freeBytes
+                : 0.0f;
+        }
+
+        /**
+         * Returns the fraction of the allocated bytes that were not requested,
+         * because of the rounding to powers of two.
+         */
+        inline float internalFragmentation() const {
+            return allocatedBytes ? 1.0f - (float) requestedBytes
+                / allocatedBytes : 0.0f;
+        }
+    };
+
+    /**
+     * Creates the arena.
+     * @param context The context where the blocks are created.
+     * @param alignment The base address alignment of the device in bytes.
+     */
+    MemoryArena(_cl_context *context, size_t alignment);
+
+    MemoryArena(const MemoryArena &) = delete;
+    MemoryArena &operator=(const MemoryArena &) = delete;
+
+    ~MemoryArena();
+
+    /**
+     * Returns a sub-buffer with at least size bytes, created with the given
+     * access flags. Throws MemoryArenaError if it fails.
+     */
+    _cl_mem *acquire(size_t size, uint64_t flags);
+
+    /**
+     * Gives back a sub-buffer returned by acquire(). Returns false, doing
+     * nothing, if the memory object doesn't belong to the arena.
+     */
+    bool release(_cl_mem *mem);
+
+    /**
+     * Releases the blocks that have nothing allocated back to the driver.
+     */
+    void trim();
+
+    /// Returns the usage and fragmentation of the arena.
+    Statistics statistics();
+
+private:
+    /**
+     * Block reserved from the driver.
+     */
+    struct Block {
+        _cl_mem *mem;                           /// Memory object.
+        std::vector<std::set<size_t>> free;     /// Free offsets by order.
+        size_t allocatedBytes;                  /// Bytes handed out.
+    };
+
+    /**
+     * Piece of a block handed out.
+     */
+    struct Allocation {
+        std::list<Block>::iterator block;       /// Block of the piece.
+        size_t offset;                          /// Offset in the block.
+        unsigned order;                         /// Order of the piece.
+        size_t size;                            /// Requested size.
+    };
+
+    /// Returns the size of the pieces of the given order.
+    inline size_t orderSize(unsigned order) {
+        return _minSize << order;
+    }
+
+    /// Returns the order of the smallest pieces with at least size bytes.
+    unsigned order(size_t size);
+
+    /**
+     * Finds or splits a free piece of the given order, reserving a new block
+     * if needed.
+     */
+    Allocation allocate(unsigned order);
+
+    /// Frees a piece, merging it with its free buddies.
+    void deallocate(const Allocation &allocation);
+
+    /// Returns if the block has nothing allocated.
+    inline bool empty(Block &block) {
+        return !block.allocatedBytes;
+    }
+
+    _cl_context *_context;                      /// Context of the blocks.
+    size_t _minSize;                            /// Size of order 0 pieces.
+    unsigned _numOrders;                        /// Orders of a block.
+    std::list<Block> _blocks;                   /// Reserved blocks.
+    std::unordered_map<_cl_mem *, Allocation> _allocations; /// Pieces.
+    size_t _requestedBytes;                     /// Bytes requested.
+    std::mutex _mutex;
+};
+
+}
+
+#endif // !PARALLELME_MEMORYARENA_HPP
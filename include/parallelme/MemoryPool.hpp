@@ -0,0 +1,142 @@
+/*                                                _    __ ____
+ *   _ __  ___ _____   ___   __  __   ___ __     / |  / /  __/
+ *  |  _ \/ _ |  _  | / _ | / / / /  / __/ /    /  | / / /__
+ *  |  __/ __ |  ___|/ __ |/ /_/ /__/ __/ /__  / / v  / /__
+ *  |_| /_/ |_|_|\_\/_/ |_/____/___/___/____/ /_/  /_/____/
+ *
+ */
+
+#ifndef PARALLELME_MEMORYPOOL_HPP
+#define PARALLELME_MEMORYPOOL_HPP
+
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "MemoryArena.hpp"
+
+struct _cl_context;
+struct _cl_mem;
+
+namespace parallelme {
+
+/**
+ * Exception thrown if the memory pool failed to allocate a memory object,
+ * even after releasing all the memory objects it retained.
+ * The error message can be accessed through the what() function.
+ */
+class MemoryPoolError : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+/**
+ * Caches the OpenCL memory objects of a device so that buffers that are
+ * created and destroyed often don't have to go through the driver's allocator
+ * every time.
+ * Memory objects are grouped in size classes: each request is rounded up to
+ * its class, and a released object is kept to be handed to the next request
+ * of the same class and flags, unless that would make the pool retain more
+ * than maxRetainedBytes().
+ * Small device memory objects are sub-allocated from a MemoryArena instead.
+ * This class is thread-safe.
+ *
+ * @author Renato Utsch
+ */
+class MemoryPool {
+    /// Identifies a list of free objects by their size class and flags, so
+    /// the lists are sorted by size.
+    typedef std::pair<size_t, uint64_t> Key;
+
+    std::map<Key, std::vector<_cl_mem *>> _free;    /// Retained objects.
+    _cl_context *_context;                          /// Context of the objects.
+    MemoryArena _arena;                             /// Small objects.
+    std::mutex _mutex;
+    size_t _maxRetainedBytes;                       /// Retained bytes cap.
+    size_t _retainedBytes;                          /// Bytes in _free.
+    size_t _hits;                                   /// Requests served by _free.
+    size_t _misses;                                 /// Requests sent to the driver.
+
+    /// Releases retained objects until at most maxBytes are retained.
+    void shrink(size_t maxBytes);
+
+public:
+    /// Default cap of the bytes retained by the pool.
+    static const size_t DefaultMaxRetainedBytes = 64 * 1024 * 1024;
+
+    /// Size of the smallest size class.
+    static const size_t MinClassSize = 256;
+
+    /**
+     * Creates the pool.
+     * @param context The context where the memory objects are created.
+     * @param alignment The base address alignment of the device in bytes.
+     * @param maxRetainedBytes The maximum number of bytes the pool keeps
+     * cached after the buffers that used them are released.
+     */
+    MemoryPool(_cl_context *context, size_t alignment,
+            size_t maxRetainedBytes = DefaultMaxRetainedBytes);
+
+    MemoryPool(const MemoryPool &) = delete;
+    MemoryPool &operator=(const MemoryPool &) = delete;
+
+    ~MemoryPool();
+
+    /**
+     * Returns the size class of the given size, that is, the real size of
+     * the memory objects handed out for it. There are four classes for each
+     * power of two, so at most 25% of an object is wasted.
+     */
+    static size_t sizeClass(size_t size);
+
+    /**
+     * Returns a memory object with at least size bytes created with the
+     * given cl_mem_flags. Throws MemoryPoolError if it fails.
+     * @param subAllocate If small objects without host memory flags may be
+     * sub-buffers of the arena. Sub-buffers can't have sub-buffers of their
+     * own.
+     */
+    _cl_mem *acquire(size_t size, uint64_t flags, bool subAllocate = true);
+
+    /**
+     * Gives back a memory object returned by acquire(). The size and flags
+     * must be the same ones used to acquire it.
+     */
+    void release(_cl_mem *mem, size_t size, uint64_t flags);
+
+    /**
+     * Returns the arena that sub-allocates the small memory objects.
+     */
+    inline MemoryArena &arena() {
+        return _arena;
+    }
+
+    /**
+     * Releases all the retained memory objects and the empty arena blocks
+     * back to the driver.
+     */
+    void trim();
+
+    /**
+     * Sets the cap of retained bytes, releasing memory objects if needed.
+     */
+    void setMaxRetainedBytes(size_t maxRetainedBytes);
+
+    /// Returns the cap of retained bytes.
+    size_t maxRetainedBytes();
+
+    /// Returns how many bytes are currently retained.
+    size_t retainedBytes();
+
+    /// Returns how many acquire() calls reused a retained object.
+    size_t hits();
+
+    /// Returns how many acquire() calls had to allocate a new object.
+    size_t misses();
+};
+
+}
+
+#endif // !PARALLELME_MEMORYPOOL_HPP
@@ -16,12 +16,19 @@
 
 #include "Buffer.hpp"
 #include "Device.hpp"
+#include "Event.hpp"
+#include "Image.hpp"
 #include "Kernel.hpp"
+#include "KernelArgs.hpp"
+#include "MemoryArena.hpp"
+#include "MemoryPool.hpp"
+#include "Profiler.hpp"
 #include "Program.hpp"
 #include "Runtime.hpp"
 #include "SchedulerFCFS.hpp"
 #include "SchedulerHEFT.hpp"
 #include "SchedulerPAMS.hpp"
 #include "Task.hpp"
+#include "WorkGroupTuner.hpp"
 
 #endif // !PARALLELME_PARALLELME_HPP
@@ -0,0 +1,159 @@
+/*                                                _    __ ____
+ *   _ __  ___ _____   ___   __  __   ___ __     / |  / /  __/
+ *  |  _ \/ _ |  _  | / _ | / / / /  / __/ /    /  | / / /__
+ *  |  __/ __ |  ___|/ __ |/ /_/ /__/ __/ /__  / / v  / /__
+ *  |_| /_/ |_|_|\_\/_/ |_/____/___/___/____/ /_/  /_/____/
+ *
+ */
+
+#ifndef PARALLELME_PROFILER_HPP
+#define PARALLELME_PROFILER_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+struct _cl_event;
+
+namespace parallelme {
+
+/**
+ * Collects the time the kernels and transfers of the runtime spend waiting
+ * in the queues and executing on the devices, from the profiling information
+ * of their OpenCL events, and aggregates it by type, name and device.
+ * Profiling is disabled by default because it adds an event to each command.
+ * It must be enabled before the Runtime is created, so the command queues
+ * of the devices are created with profiling enabled.
+ * This class is thread-safe.
+ *
+ * @author Renato Utsch
+ */
+class Profiler {
+public:
+    /**
+     * Type of a profiled command.
+     */
+    enum Command {
+        KernelCommand,      /// Execution of a kernel.
+        TransferCommand     /// Read, write, copy or map of memory.
+    };
+
+    /**
+     * Times of the commands with the same type and name on the same device,
+     * in nanoseconds. Kernels are kept apart from transfers of the same
+     * name.
+     */
+    struct Statistics {
+        /// Name of the kernel, or type of the transfer.
+        std::string name;
+
+        /// ID of the device.
+        unsigned deviceID;
+
+        /// Type of the commands.
+        Command command;
+
+        /// Number of commands.
+        size_t count;
+
+        /// Total time between queueing and submitting the commands to the
+        /// device.
+        uint64_t queueTime;
+
+        /// Total time between submitting and starting the commands.
+        uint64_t submitTime;
+
+        /// Total time the commands executed.
+        uint64_t executionTime;
+
+        /// Shortest execution of a command.
+        uint64_t minExecutionTime;
+
+        /// Longest execution of a command.
+        uint64_t maxExecutionTime;
+    };
+
+    /// Returns the instance of the profiler.
+    static Profiler &instance();
+
+    Profiler(const Profiler &) = delete;
+    Profiler &operator=(const Profiler &) = delete;
+
+    ~Profiler();
+
+    /**
+     * Enables or disables profiling. Only affects the devices created
+     * afterwards.
+     */
+    inline void setEnabled(bool enabled) {
+        _enabled = enabled;
+    }
+
+    /// Returns if profiling is enabled.
+    inline bool enabled() {
+        return _enabled;
+    }
+
+    /**
+     * Returns the given pointer if profiling is enabled, or nullptr if not,
+     * to be given as the event output of the command to profile.
+     */
+    inline _cl_event **track(_cl_event **event) {
+        return _enabled ? event : nullptr;
+    }
+
+    /**
+     * Records a command, taking ownership of its event. The times are read
+     * once the command finishes. Does nothing if the event is nullptr.
+     */
+    void record(unsigned deviceID, const std::string &name, Command command,
+            _cl_event *event);
+
+    /**
+     * Waits for the recorded commands to finish and returns their times by
+     * type, name and device.
+     */
+    std::vector<Statistics> statistics();
+
+    /// Discards the times recorded so far.
+    void reset();
+
+private:
+    /**
+     * Command recorded that may not have finished yet.
+     */
+    struct Pending {
+        unsigned deviceID;
+        std::string name;
+        Command command;
+        _cl_event *event;
+    };
+
+    /// Identifies the statistics of commands by type, name and device.
+    typedef std::tuple<Command, std::string, unsigned> Key;
+
+    /// Pending commands that trigger reading the finished ones.
+    static const size_t MaxPending = 256;
+
+    Profiler();
+
+    /**
+     * Adds the times of the pending commands that finished to the
+     * statistics, waiting for all of them if wait is true.
+     */
+    void collect(bool wait);
+
+    std::atomic<bool> _enabled;
+    std::vector<Pending> _pending;
+    std::map<Key, Statistics> _statistics;
+    std::mutex _mutex;
+};
+
+}
+
+#endif // !PARALLELME_PROFILER_HPP
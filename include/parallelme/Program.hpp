@@ -9,14 +9,23 @@
 #ifndef PARALLELME_PROGRAM_HPP
 #define PARALLELME_PROGRAM_HPP
 
+#include <cstdint>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
 #include "Device.hpp"
 
 struct _cl_program;
+struct _cl_kernel;
 
 namespace parallelme {
+class Kernel;
+class KernelArgs;
 class Runtime;
 
 /**
@@ -31,16 +40,56 @@ class ProgramCompilationError : public std::runtime_error {
 /**
  * The Program class stores the program objects from each device the source
  * was able to compile to.
+ * The source is compiled after a prelude with helpers for kernels executed
+ * with Kernel::setPaddedWorkSize():
+ *  - PM_WORK_SIZE declares the last argument of the kernel, with the work
+ *    size before padding;
+ *  - PM_IN_RANGE() returns if the global id of the item is inside it;
+ *  - PM_GLOBAL_SIZE(dim) returns its size in the given dimension.
  *
  * @author Renato Utsch
  */
 class Program {
+    friend class Kernel;
+
+    /// Identifies the kernels of a device by name.
+    typedef std::pair<unsigned, std::string> KernelKey;
+
+    /**
+     * Kernel kept in the cache with the arguments last set to it, so that
+     * the next tasks can skip setting the same values again.
+     */
+    struct CachedKernel {
+        _cl_kernel *kernel;                 /// Kernel object.
+        std::vector<std::string> args;      /// Bytes of each primitive set.
+        std::weak_ptr<const KernelArgs> validated; /// Last pack validated.
+        size_t preferredMultiple;           /// Work-group multiple, or 0.
+    };
+
     std::map<unsigned, _cl_program *> _programs;    /// Maps device id to program.
     std::set<Device::Type> _deviceTypes;            /// Set of the device types.
+    std::set<Device::Type> _nativeDeviceTypes;      /// Types running natives.
+    uint64_t _sourceHash;                           /// Hash of source and flags.
+    std::map<KernelKey, std::vector<CachedKernel>> _kernelCache; /// Idle kernels.
+    std::mutex _kernelMutex;
 
     /// Prints the build log to the error stream.
     void printBuildLog(_cl_program *program, Device &device);
 
+    /**
+     * Takes an idle kernel with the given name from the cache of the device.
+     * Returns a kernel set to nullptr if all the kernels created before are
+     * in use, in which case the caller creates a new one.
+     */
+    CachedKernel takeKernel(unsigned deviceID, const std::string &name);
+
+    /**
+     * Gives back a kernel taken from the cache or created by the caller, so
+     * that the next tasks reuse it.
+     */
+    void cacheKernel(unsigned deviceID, const std::string &name,
+            CachedKernel &&kernel);
+
 public:
     /**
      * Creates the program. A program is the compiled source that can be executed
@@ -66,6 +115,15 @@ public:
         return _programs[deviceID];
     }
 
+    /**
+     * Returns a hash of the source code and compiler flags that is the same
+     * on every execution of the application, identifying the program in
+     * data saved to disk.
+     */
+    inline uint64_t sourceHash() const {
+        return _sourceHash;
+    }
+
     /**
      * Returns if the program has a device ID.
      */
@@ -79,6 +137,21 @@ public:
     bool hasDeviceType(Device::Type type) const {
          return _deviceTypes.find(type) != _deviceTypes.end();
     }
+
+    /**
+     * Returns if the program has a device of the type that executes native
+     * kernels.
+     */
+    bool hasNativeDeviceType(Device::Type type) const {
+         return _nativeDeviceTypes.find(type) != _nativeDeviceTypes.end();
+    }
+
+    /**
+     * Returns if the program has a device that executes native kernels.
+     */
+    bool hasNativeDevice() const {
+         return !_nativeDeviceTypes.empty();
+    }
 };
 
 }
@@ -15,10 +15,10 @@
 #include <string>
 #include <unordered_map>
 #include <vector>
+#include "Device.hpp"
 
 namespace parallelme {
 class Buffer;
-class Device;
 class Kernel;
 class Program;
 class Worker;
@@ -37,6 +37,14 @@ class InvalidKernelError : public std::runtime_error {
     using std::runtime_error::runtime_error;
 };
 
+/**
+ * Exception thrown if the user configured an invalid tiling for a task.
+ * The error message can be accessed through the what() function.
+ */
+class InvalidTilingError : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
 /**
  * Represents a single task to be executed by the target device. Can be
  * composed of multiple kernels.
@@ -69,12 +77,49 @@ public:
             : cpuScore(cpu), gpuScore(gpu), acceleratorScore(acc) { }
     };
 
+    /**
+     * Part of the rows of a tiled task that the kernels process at once.
+     */
+    struct Tile {
+        /// Input rows of the tile, preceded and followed by the halo rows.
+        std::shared_ptr<Buffer> input;
+
+        /// Output rows of the tile, without halo.
+        std::shared_ptr<Buffer> output;
+
+        /// Index of the first row of the tile, not counting the halo.
+        size_t firstRow;
+
+        /// Number of rows of the tile, not counting the halo.
+        size_t rows;
+
+        /// Number of halo rows before the tile in the input buffer.
+        size_t haloBefore;
+
+        /// Number of halo rows after the tile in the input buffer.
+        size_t haloAfter;
+    };
+
     /**
      * Callback function called before the task is executed to configure the
      * task.
      */
     typedef std::function<void (DevicePtr &, KernelHash &)> KernelFunction;
 
+    /**
+     * Callback function called before the kernels are executed on each tile
+     * to set the tile's buffers and sizes as arguments of the kernels.
+     */
+    typedef std::function<void (DevicePtr &, KernelHash &, const Tile &)>
+        TileFunction;
+
+    /**
+     * C++ function executed as a native kernel. Receives, for each argument
+     * id, the host address of the buffer's memory or of the primitive value,
+     * or nullptr if the argument wasn't set.
+     */
+    typedef std::function<void (void **args)> NativeFunction;
+
     /**
      * Creates a task.
      * A task is composed of multiple kernels that are dependent of each other.
@@ -93,6 +138,26 @@ public:
      */
     Task *addKernel(const std::string &name);
 
+    /**
+     * Adds a native kernel to the task, which runs a C++ function in the
+     * order of the kernels, on the queue of the device. Its arguments are set
+     * like the ones of the other kernels, and the buffers are given to the
+     * function in the memory of the device, without copies to the host.
+     * Tasks with native kernels only run on devices that support them,
+     * usually CPUs, and aren't co-executed. The function must not throw.
+     * Throws InvalidKernelError if no device of the program supports them.
+     * @param name Name used to access the kernel in the KernelHash.
+     * @param function Function executed by the kernel.
+     */
+    Task *addNativeKernel(const std::string &name, NativeFunction function);
+
+    /**
+     * Declares a buffer used by the task. Devices over their memory budget
+     * don't evict the buffer from when the task is submitted until it
+     * finishes, so it doesn't have to be brought back when the task runs.
+     */
+    Task *addBuffer(std::shared_ptr<Buffer> buffer);
+
     /**
      * This function prepares the Task to be executed by a worker. It is called
      * after the scheduler decides where the task will run on, so that buffers
@@ -110,6 +175,57 @@ public:
         _finishFunction = finishFunction;
     }
 
+    /**
+     * Makes the task process a host input that may be larger than the memory
+     * of the device in tiles of rows. Only two tiles of input and output are
+     * kept on the device: while the kernels run on one tile, the input of the
+     * next tile is uploaded and the output of the previous one is
+     * downloaded.
+     * The kernels are executed once per tile, after the tile function sets
+     * their arguments. The config function is still called once, before the
+     * first tile, and the finish function after the output of all the tiles
+     * is copied back.
+     * @param input Host input, with rows of inputRowSize bytes. Must be kept
+     * alive until the task finishes.
+     * @param inputRowSize Size in bytes of each input row.
+     * @param output Host output, with rows of outputRowSize bytes. Must be
+     * kept alive until the task finishes.
+     * @param outputRowSize Size in bytes of each output row.
+     * @param rows Number of rows of the input and of the output.
+     * @param tileRows Maximum number of rows of each tile.
+     * @param haloRows Number of input rows before and after each tile that are
+     * uploaded with it, for kernels that read the neighbours of a row.
+     * Throws InvalidTilingError if the sizes are invalid.
+     */
+    Task *setTiling(void *input, size_t inputRowSize, void *output,
+            size_t outputRowSize, size_t rows, size_t tileRows,
+            size_t haloRows = 0);
+
+    /**
+     * Splits the range of each kernel of the task across the given devices,
+     * so that all of them execute a part of it at the same time. The range is
+     * split along its last dimension with more than one item, with parts
+     * sized from the throughput measured on the previous executions of the
+     * task, starting from the task's score of each device type.
+     * The config function is called once for each device with its kernels,
+     * and the finish function once, on the device of the worker that runs the
+     * task. Each part must only write its own slice of the buffers, laid out
+     * along the split dimension, and the kernels of a part must not read what
+     * the kernels of other parts write. The slices stay on the devices that
+     * wrote them until the buffer is read, which merges them.
+     * Devices the program wasn't built for are skipped, and tiled tasks
+     * aren't split.
+     */
+    Task *setCoExecution(std::vector<DevicePtr> devices);
+
+    /**
+     * Sets the function called before the kernels run on each tile.
+     * @see setTiling
+     */
+    inline void setTileFunction(TileFunction tileFunction) {
+        _tileFunction = tileFunction;
+    }
+
     /**
      * Returns the score of the task.
      */
@@ -124,19 +240,53 @@ public:
         return *_program;
     }
 
+    /**
+     * Returns if the task can run on the device.
+     */
+    bool runsOn(Device &device) const;
+
+    /**
+     * Returns if the task can run on devices of the given type.
+     */
+    bool hasDeviceType(Device::Type type) const;
+
 private:
     // Only the Worker can callFinishFunction().
     friend class Worker;
+    friend class Runtime;
+
+    /**
+     * Pins the buffers of the task, until it is destroyed. Called when the
+     * task is submitted.
+     */
+    void pinBuffers();
 
     /**
      * Creates the Kernels.
      */
     void createKernels(std::shared_ptr<Device> &device);
 
+    /**
+     * Creates the kernels of a device.
+     */
+    void createKernels(std::shared_ptr<Device> &device,
+            std::vector<std::shared_ptr<Kernel>> &kernels,
+            KernelHash &kernelHash);
+
+    /**
+     * Creates the kernels of the other devices that co-execute the task and
+     * splits the range of all the kernels between the devices.
+     */
+    void createParts(std::shared_ptr<Device> &device);
+
     /// Calls the configFunction currently set or does nothing if it wasn't set.
     inline void callConfigFunction(std::shared_ptr<Device> &device) {
-        if(_configFunction)
-            _configFunction(device, _kernelHash);
+        if(!_configFunction)
+            return;
+
+        _configFunction(device, _kernelHash);
+        for(auto &part : _parts)
+            _configFunction(part.device, part.kernelHash);
     }
 
     /// Calls the finishFunction currently set or does nothing if it wasn't set.
@@ -145,19 +295,80 @@ private:
             _finishFunction(device, _kernelHash);
     }
 
+    /**
+     * Executes the kernels in the order they were created, once for each tile
+     * if the task is tiled.
+     */
+    void run(std::shared_ptr<Device> &device);
+
     /**
      * Executes the kernels in the order they were created.
      */
-    void run();
+    void runKernels();
+
+    /**
+     * Executes the kernels over all the tiles.
+     */
+    void runTiles(std::shared_ptr<Device> &device);
+
+    /**
+     * Executes the parts of the kernels on all the devices, waiting for them
+     * to finish, and updates the split from the time each device took.
+     */
+    void runParts(std::shared_ptr<Device> &device);
+
+    /**
+     * Returns the key that identifies the task in the split of co-executed
+     * tasks.
+     */
+    std::string splitKey();
+
+    /**
+     * Returns the tile with the given index, whose rows are stored in the
+     * given buffers.
+     */
+    Tile tile(size_t index, std::shared_ptr<Buffer> &input,
+            std::shared_ptr<Buffer> &output);
+
+    /**
+     * Rows of the host input and output of a tiled task.
+     */
+    struct Tiling {
+        void *input;
+        size_t inputRowSize;
+        void *output;
+        size_t outputRowSize;
+        size_t rows;
+        size_t tileRows;
+        size_t haloRows;
+    };
 
     Score _score;                       // Score of the task.
     KernelFunction _configFunction;     // Task's config function.
     KernelFunction _finishFunction;     // Task's finish function.
+    TileFunction _tileFunction;         // Task's tile function.
+    Tiling _tiling;                     // Rows to tile, if tileRows isn't 0.
     std::shared_ptr<Program> _program;  // Program with the kernels.
 
+    /**
+     * Kernels of another device that executes part of the task.
+     */
+    struct Part {
+        DevicePtr device;
+        KernelHash kernelHash;
+        std::vector<std::shared_ptr<Kernel>> kernels;
+    };
+
     std::vector<std::string> _kernelNames; // Names of the kernels to be created.
+    // Functions of the native kernels by name.
+    std::unordered_map<std::string, NativeFunction> _nativeFunctions;
     KernelHash _kernelHash; // Access kernel by name.
     std::vector<std::shared_ptr<Kernel>> _kernels; // Order of execution.
+    std::vector<DevicePtr> _coDevices;  // Devices that co-execute the task.
+    std::vector<Part> _parts;           // Parts of the other devices.
+    std::vector<double> _split;         // Fractions where each part begins.
+    std::vector<std::shared_ptr<Buffer>> _buffers; // Buffers used by the task.
+    bool _pinned;                       // If the buffers are pinned.
 };
 
 }
@@ -0,0 +1,128 @@
+/*                                                _    __ ____
+ *   _ __  ___ _____   ___   __  __   ___ __     / |  / /  __/
+ *  |  _ \/ _ |  _  | / _ | / / / /  / __/ /    /  | / / /__
+ *  |  __/ __ |  ___|/ __ |/ /_/ /__/ __/ /__  / / v  / /__
+ *  |_| /_/ |_|_|\_\/_/ |_/____/___/___/____/ /_/  /_/____/
+ *
+ */
+
+#ifndef PARALLELME_WORKGROUPTUNER_HPP
+#define PARALLELME_WORKGROUPTUNER_HPP
+
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct _cl_kernel;
+
+namespace parallelme {
+class Device;
+
+/**
+ * Chooses the local work size of the kernels. The first executions of a
+ * kernel on a device with a class of global sizes each try one of the
+ * work-group shapes allowed by clGetKernelWorkGroupInfo(), and the fastest
+ * one is used by the executions that follow.
+ * Each candidate runs once with the kernel's real arguments, instead of
+ * running the kernel many times on its own, because a kernel that updates
+ * its buffers in place would give wrong results if run more than once.
+ * The choices can be saved to a file and loaded on the next execution of
+ * the application, so they are only tuned once.
+ * Tuning is disabled by default because the trials wait for the device to
+ * finish before and after the timed executions.
+ * This class is thread-safe.
+ *
+ * @author Renato Utsch
+ */
+class WorkGroupTuner {
+public:
+    /// Local work size. All zeros lets the driver choose it.
+    typedef std::array<size_t, 3> Shape;
+
+    /**
+     * Local work size chosen for an execution of a kernel.
+     */
+    struct Choice {
+        std::string key;    /// Identifies the kernel, device and sizes.
+        Shape local;        /// Local work size to use.
+        int trial;          /// Candidate being timed, or -1 if not timed.
+    };
+
+    /// Returns the instance of the tuner.
+    static WorkGroupTuner &instance();
+
+    WorkGroupTuner(const WorkGroupTuner &) = delete;
+    WorkGroupTuner &operator=(const WorkGroupTuner &) = delete;
+
+    /**
+     * Sets the file where the choices are saved, loading the choices saved
+     * in it before. On Android, this should be in the application's files or
+     * cache directory. Without a file the choices are only kept in memory.
+     */
+    void setCachePath(const std::string &path);
+
+    /**
+     * Enables or disables the tuning. When disabled the driver chooses the
+     * local work size. Disabled by default.
+     */
+    void setEnabled(bool enabled);
+
+    /**
+     * Returns the local work size for an execution of the kernel with the
+     * given global work size. If the choice has a trial, the execution must
+     * be timed and given to finishTrial().
+     * @param program Hash of the kernel's program.
+     * @param name Name of the kernel.
+     */
+    Choice choose(Device &device, _cl_kernel *kernel, uint64_t program,
+            const std::string &name, const size_t global[3]);
+
+    /**
+     * Records how long the trial of a choice took, or that it failed if the
+     * time is negative. Once all the candidates are timed the fastest is
+     * chosen and saved.
+     */
+    void finishTrial(const Choice &choice, double seconds);
+
+private:
+    /**
+     * Tuning state of a kernel, device and class of global sizes.
+     */
+    struct Entry {
+        std::vector<Shape> candidates;  /// Shapes to try, driver's first.
+        std::vector<double> times;      /// Time of each candidate tried.
+        Shape best;                     /// Fastest shape, once tuned.
+        bool warm;                      /// If the kernel ran once untimed.
+        bool tuned;                     /// If all candidates were tried.
+    };
+
+    WorkGroupTuner();
+
+    /// Returns the name and driver version of the device, without spaces.
+    std::string deviceSignature(Device &device);
+
+    /**
+     * Returns the shapes allowed for the kernel on the device that divide
+     * the global work size.
+     */
+    std::vector<Shape> candidates(Device &device, _cl_kernel *kernel,
+            const size_t global[3]);
+
+    /// Writes the tuned choices to the cache file.
+    void save();
+
+    std::unordered_map<std::string, Entry> _entries;
+    std::map<unsigned, std::string> _signatures; /// Signatures by device ID.
+    std::string _path;                          /// Cache file.
+    bool _enabled;
+    std::mutex _mutex;
+};
+
+}
+
+#endif // !PARALLELME_WORKGROUPTUNER_HPP
@@ -8,46 +8,184 @@
 
 #include <parallelme/Buffer.hpp>
 #include <parallelme/Device.hpp>
+#include <parallelme/Event.hpp>
+#include <parallelme/MemoryArena.hpp>
+#include <parallelme/MemoryPool.hpp>
 #include <parallelme/Runtime.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iterator>
 #include <string>
+#include <utility>
 #include <android/bitmap.h>
+#include <fcntl.h>
 #include <jni.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "ProfiledCommand.hpp"
+#include "StagingRing.hpp"
+#include "ThreadEnv.hpp"
+#include "TransferEngine.hpp"
 #include "dynloader/dynLoader.h"
 using namespace parallelme;
 
-Buffer::Buffer(size_t size) : _size(size), _mem(nullptr), _device(nullptr),
-        _copyPtr(nullptr), _copyArray(nullptr), _copyBitmap(nullptr) {
+/// Frees the host storage of a memory object after the driver destroys it.
+static void CL_CALLBACK freeHostStorage(cl_mem, void *host) {
+    free(host);
+}
+
+/// Records an asynchronous transfer, whose event is also used elsewhere.
+static void profileAsync(unsigned deviceID, const char *name,
+        _cl_event *event) {
+    auto &profiler = Profiler::instance();
+    if(!profiler.enabled())
+        return;
+
+    clRetainEvent(event);
+    profiler.record(deviceID, name, Profiler::TransferCommand, event);
+}
+
+/// Frees the host block of a write after the device read it.
+static void CL_CALLBACK freeWrittenBlock(cl_event, cl_int, void *block) {
+    free(block);
+}
+
+/// Unmaps the file pages of a memory object after the driver destroys it.
+static void CL_CALLBACK unmapHostStorage(cl_mem, void *mapping) {
+    auto region = (std::pair<void *, size_t> *) mapping;
+    munmap(region->first, region->second);
+    delete region;
+}
+
+/// Direct ByteBuffer used as the storage of a memory object.
+typedef std::pair<JavaVM *, jobject> DirectStorage;
+
+/// Releases the ByteBuffer, from whatever thread the driver calls it.
+static void CL_CALLBACK releaseDirectStorage(cl_mem, void *storage) {
+    auto direct = (DirectStorage *) storage;
+    {
+        ThreadEnv env(direct->first);
+        if(env.get())
+            env.get()->DeleteGlobalRef(direct->second);
+    }
+    delete direct;
+}
+
+Buffer::Buffer(size_t size, Allocation allocation) : _size(size),
+        _allocation(allocation), _parent(nullptr), _offset(0),
+        _hostCopy(nullptr), _hostShadow(false), _device(nullptr),
+        _mapped(nullptr), _copyPtr(nullptr), _copyFile(), _copyDirect(nullptr),
+        _copyDirectRef(nullptr), _copyArray(nullptr), _copyBitmap(nullptr),
+        _vm(nullptr), _pins(0) {
+
+}
+
+Buffer::Buffer(std::shared_ptr<Buffer> parent, size_t offset, size_t size)
+        : _size(size), _allocation(parent->_allocation), _parent(parent),
+        _offset(offset), _hostCopy(nullptr), _hostShadow(false),
+        _device(nullptr), _mapped(nullptr), _copyPtr(nullptr), _copyFile(),
+        _copyDirect(nullptr), _copyDirectRef(nullptr), _copyArray(nullptr),
+        _copyBitmap(nullptr), _vm(nullptr), _pins(0) {
 
 }
 
 Buffer::~Buffer() {
-    if(_mem) {
-        clReleaseMemObject(_mem);
-        _mem = nullptr;
+    // Devices may try to evict the buffer until its copies are deallocated.
+    std::lock_guard<std::recursive_mutex> lock(root()._mutex);
+    unmap();
+    releaseFileSource();
+    free(_hostCopy);
+
+    for(auto &it : _subBuffers)
+        clReleaseMemObject(it.second.second);
+
+    for(auto &it : _replicas) {
+        auto &replica = it.second;
+
+        // The memory object can't go back to the pool while a transfer uses it.
+        if(replica.transferEvent) {
+            clWaitForEvents(1, &replica.transferEvent);
+            clReleaseEvent(replica.transferEvent);
+        }
+        deallocate(replica.mem, replica.flags, replica.device);
     }
 }
 
 void Buffer::setJArraySource(JNIEnv *env, jarray array) {
+    std::lock_guard<std::recursive_mutex> lock(root()._mutex);
     releaseCopySources(env);
 
     _copyArray = (jarray) env->NewGlobalRef(array);
     if(!_copyArray)
         throw BufferCopyError("Failed to create a new jarray global ref.");
+    env->GetJavaVM(&_vm);
 }
 
 void Buffer::setAndroidBitmapSource(JNIEnv *env, jobject bitmap) {
+    std::lock_guard<std::recursive_mutex> lock(root()._mutex);
     releaseCopySources(env);
 
     _copyBitmap = env->NewGlobalRef(bitmap);
     if(!_copyBitmap)
         throw BufferCopyError("Failed to create a new bitmap global ref.");
+    env->GetJavaVM(&_vm);
 }
 
 void Buffer::setSource(void *host) {
+    std::lock_guard<std::recursive_mutex> lock(root()._mutex);
     // Other copy sources will be released when calling makeCopy().
     _copyPtr = host;
 }
 
+void Buffer::setFileSource(const std::string &path, size_t offset) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        throw BufferCopyError(path + ": " + strerror(errno));
+
+    struct stat info;
+    if(fstat(fd, &info) < 0 || (size_t) info.st_size < offset
+            || (size_t) info.st_size - offset < _size) {
+        close(fd);
+        throw BufferCopyError(path + ": the file is smaller than the buffer.");
+    }
+
+    // Private writable pages let the device use them without changing the
+    // file, as writes only create private copies of the pages.
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = offset / page * page;
+    size_t length = offset - start + _size;
+    void *address = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+            fd, start);
+    close(fd);
+    if(address == MAP_FAILED)
+        throw BufferCopyError(path + ": " + strerror(errno));
+
+    std::lock_guard<std::recursive_mutex> lock(root()._mutex);
+    // Other copy sources will be released when calling makeCopy().
+    _copyPtr = nullptr;
+    _copyDirect = nullptr;
+    releaseFileSource();
+    _copyFile.address = address;
+    _copyFile.length = length;
+    _copyFile.data = (char *) address + (offset - start);
+}
+
+void Buffer::setDirectByteBufferSource(JNIEnv *env, jobject byteBuffer) {
+    void *host = directByteBufferAddress(env, byteBuffer);
+
+    std::lock_guard<std::recursive_mutex> lock(root()._mutex);
+    releaseCopySources(env);
+    _copyDirect = host;
+    _copyDirectRef = env->NewGlobalRef(byteBuffer);
+    env->GetJavaVM(&_vm);
+}
+
+void Buffer::copyToDirectByteBuffer(JNIEnv *env, jobject byteBuffer) {
+    copyTo(directByteBufferAddress(env, byteBuffer));
+}
+
 void Buffer::copyToJArray(JNIEnv *env, jarray array) {
     void *ptr = env->GetPrimitiveArrayCritical(array, nullptr);
     if(!ptr)
@@ -70,62 +208,1217 @@ void Buffer::copyToAndroidBitmap(JNIEnv *env, jobject bitmap) {
 }
 
 void Buffer::copyTo(void *host) {
-    auto mem = clMem(_device);
+    auto &owner = root();
+    std::lock_guard<std::recursive_mutex> lock(owner._mutex);
+    if((hasCopySource() || owner.hasCopySource()) && lastDevice())
+        flushSources(owner.replica(lastDevice()));
+
+    if(owner._hostShadow) {
+        owner.updateShadow(_offset, _offset + _size, lastDevice());
+        TransferEngine::instance().copy(host,
+                (char *) owner._hostCopy + _offset, _size);
+        return;
+    }
+
+    auto replica = owner.readReplica(_offset, _offset + _size, lastDevice());
+    if(!replica)
+        throw BufferEmptyError("No device has the contents of the buffer.");
+    owner.waitTransfer(*replica);
+
     int err;
+    auto queue = replica->device->clQueue();
+    ProfiledCommand map(replica->device->id(), "map");
+    void *data = clEnqueueMapBuffer(queue, replica->mem, CL_TRUE,
+            CL_MAP_READ, _offset, _size, 0, nullptr, map.event(), &err);
+    if(err < 0)
+        throw BufferCopyError(std::to_string(err));
+
+    // Zero-copy memory may already be the destination.
+    if(data != host)
+        TransferEngine::instance().copy(host, data, _size);
+    clEnqueueUnmapMemObject(queue, replica->mem, data, 0, nullptr, nullptr);
+}
+
+void Buffer::copyTo(void *host, size_t offset, size_t length) {
+    if(offset > _size || length > _size - offset)
+        throw BufferCopyError("The range doesn't fit in the buffer.");
+
+    auto &owner = root();
+    std::lock_guard<std::recursive_mutex> lock(owner._mutex);
+    if((hasCopySource() || owner.hasCopySource()) && lastDevice())
+        flushSources(owner.replica(lastDevice()));
+
+    size_t begin = _offset + offset;
+    if(owner._hostShadow) {
+        owner.updateShadow(begin, begin + length, lastDevice());
+        TransferEngine::instance().copy(host,
+                (char *) owner._hostCopy + begin, length);
+        return;
+    }
 
-    void *data = clEnqueueMapBuffer(_device->clQueue(), mem, CL_TRUE,
-            CL_MAP_READ, 0, _size, 0, nullptr, nullptr, &err);
+    auto replica = owner.readReplica(begin, begin + length, lastDevice());
+    if(!replica)
+        throw BufferEmptyError("No device has the contents of the buffer.");
+    owner.waitTransfer(*replica);
+
+    ProfiledCommand read(replica->device->id(), "read");
+    int err = clEnqueueReadBuffer(replica->device->clQueue(), replica->mem,
+            CL_TRUE, begin, length, host, 0, nullptr, read.event());
+    if(err < 0)
+        throw BufferCopyError(std::to_string(err));
+}
+
+void Buffer::copyTo(void *host, const Rect &rect) {
+    auto span = rectSpan(rect);
+    if(span.first == span.second)
+        return;
+
+    auto &owner = root();
+    std::lock_guard<std::recursive_mutex> lock(owner._mutex);
+    if((hasCopySource() || owner.hasCopySource()) && lastDevice())
+        flushSources(owner.replica(lastDevice()));
+
+    auto replica = owner.readReplica(span.first, span.second, lastDevice());
+    if(!replica)
+        throw BufferEmptyError("No device has the contents of the buffer.");
+    owner.waitTransfer(*replica);
+
+    size_t bufferOrigin[] = { _offset + rect.x, rect.y, 0 };
+    size_t hostOrigin[] = { 0, 0, 0 };
+    size_t region[] = { rect.width, rect.height, 1 };
+    ProfiledCommand read(replica->device->id(), "read");
+    int err = clEnqueueReadBufferRect(replica->device->clQueue(),
+            replica->mem, CL_TRUE, bufferOrigin, hostOrigin, region,
+            rect.rowPitch, 0, rect.hostRowPitch, 0, host, 0, nullptr,
+            read.event());
+    if(err < 0)
+        throw BufferCopyError(std::to_string(err));
+}
+
+void Buffer::copyFrom(const void *host, size_t offset, size_t length) {
+    if(offset > _size || length > _size - offset)
+        throw BufferCopyError("The range doesn't fit in the buffer.");
+
+    auto &owner = root();
+    std::lock_guard<std::recursive_mutex> lock(owner._mutex);
+    auto device = lastDevice();
+    if(!device)
+        throw BufferEmptyError("No device used the buffer yet.");
+
+    // Sources saved before this call are older, so they are copied first.
+    unmap();
+    auto &replica = owner.replica(device);
+    flushSources(replica);
+    owner.waitTransfer(replica);
+
+    size_t begin = _offset + offset;
+    ProfiledCommand write(device->id(), "write");
+    int err = clEnqueueWriteBuffer(device->clQueue(), replica.mem, CL_TRUE,
+            begin, length, host, 0, nullptr, write.event());
     if(err < 0)
         throw BufferCopyError(std::to_string(err));
 
-    memcpy(host, data, _size);
-    clEnqueueUnmapMemObject(_device->clQueue(), mem, data, 0, nullptr, nullptr);
+    owner.markWritten(replica, begin, begin + length);
+    _device = device;
 }
 
-_cl_mem *Buffer::clMem(std::shared_ptr<Device> device) {
-    if(_device != device)
-        createMemoryObject(device, !hasCopySource());
+void Buffer::copyFrom(const void *host, const Rect &rect) {
+    auto span = rectSpan(rect);
+    if(span.first == span.second)
+        return;
+
+    auto &owner = root();
+    std::lock_guard<std::recursive_mutex> lock(owner._mutex);
+    auto device = lastDevice();
+    if(!device)
+        throw BufferEmptyError("No device used the buffer yet.");
+
+    // Sources saved before this call are older, so they are copied first.
+    unmap();
+    auto &replica = owner.replica(device);
+    flushSources(replica);
+    owner.waitTransfer(replica);
+
+    size_t bufferOrigin[] = { _offset + rect.x, rect.y, 0 };
+    size_t hostOrigin[] = { 0, 0, 0 };
+    size_t region[] = { rect.width, rect.height, 1 };
+    ProfiledCommand write(device->id(), "write");
+    int err = clEnqueueWriteBufferRect(device->clQueue(), replica.mem,
+            CL_TRUE, bufferOrigin, hostOrigin, region, rect.rowPitch, 0,
+            rect.hostRowPitch, 0, host, 0, nullptr, write.event());
+    if(err < 0)
+        throw BufferCopyError(std::to_string(err));
+
+    // Only the rows of the region are up to date on other devices.
+    for(size_t row = 0; row < rect.height; ++row) {
+        size_t begin = _offset + (rect.y + row) * rect.rowPitch + rect.x;
+        owner.markWritten(replica, begin, begin + rect.width);
+    }
+    _device = device;
+}
+
+void *Buffer::directByteBufferAddress(JNIEnv *env, jobject byteBuffer) {
+    void *host = env->GetDirectBufferAddress(byteBuffer);
+    if(!host)
+        throw BufferCopyError("The ByteBuffer isn't direct.");
+    if(env->GetDirectBufferCapacity(byteBuffer) < (jlong) _size)
+        throw BufferCopyError("The ByteBuffer is smaller than the buffer.");
+
+    return host;
+}
+
+void Buffer::copyToFile(const std::string &path) {
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+        throw BufferCopyError(path + ": " + strerror(errno));
+
+    if(ftruncate(fd, _size) < 0) {
+        close(fd);
+        throw BufferCopyError(path + ": " + strerror(errno));
+    }
+
+    void *address = mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            fd, 0);
+    close(fd);
+    if(address == MAP_FAILED)
+        throw BufferCopyError(path + ": " + strerror(errno));
+
+    try {
+        copyTo(address);
+    }
+    catch(...) {
+        munmap(address, _size);
+        throw;
+    }
+    munmap(address, _size);
+}
+
+void Buffer::copyFrom(Buffer &source, size_t sourceOffset, size_t offset,
+        size_t length) {
+    if(sourceOffset > source._size || length > source._size - sourceOffset
+            || offset > _size || length > _size - offset)
+        throw BufferCopyError("The range doesn't fit in the buffer.");
+    if(!length)
+        return;
+
+    auto &owner = root();
+    auto &sourceOwner = source.root();
+    size_t begin = _offset + offset;
+    size_t sourceBegin = source._offset + sourceOffset;
+    if(&owner == &sourceOwner && begin < sourceBegin + length
+            && sourceBegin < begin + length)
+        throw BufferCopyError("The ranges overlap.");
+
+    std::unique_lock<std::recursive_mutex> lock(owner._mutex, std::defer_lock);
+    std::unique_lock<std::recursive_mutex> sourceLock(sourceOwner._mutex,
+            std::defer_lock);
+    if(&owner == &sourceOwner)
+        lock.lock();
+    else
+        std::lock(lock, sourceLock);
+
+    auto device = lastDevice() ? lastDevice() : source.lastDevice();
+    if(!device)
+        throw BufferEmptyError("No device has the contents of the buffer.");
+
+    // The source's host data may be newer than its copies.
+    if(source.hasCopySource() || sourceOwner.hasCopySource())
+        source.flushSources(sourceOwner.replica(device));
+    if(!sourceOwner.readReplica(sourceBegin, sourceBegin + length, device))
+        throw BufferEmptyError("No device has the contents of the buffer.");
+    auto &sourceReplica = sourceOwner.replica(device);
+    sourceOwner.validate(sourceReplica, sourceBegin, sourceBegin + length);
+
+    // Allocating the destination must not evict the source.
+    sourceReplica.lastTask = device->currentTask();
+
+    // Sources saved before this call are older, so they are copied first.
+    unmap();
+    auto &replica = owner.replica(device);
+    flushSources(replica);
+    sourceOwner.waitTransfer(sourceReplica);
+    owner.waitTransfer(replica);
+
+    ProfiledCommand copy(device->id(), "copy");
+    int err = clEnqueueCopyBuffer(device->clQueue(), sourceReplica.mem,
+            replica.mem, sourceBegin, begin, length, 0, nullptr, copy.event());
+    if(err < 0)
+        throw BufferCopyError(std::to_string(err));
+
+    owner.markWritten(replica, begin, begin + length);
+    _device = device;
+}
+
+void Buffer::copyFrom(Buffer &source) {
+    if(source._size != _size)
+        throw BufferCopyError("The buffers have different sizes.");
+
+    copyFrom(source, 0, 0, _size);
+}
+
+void Buffer::fill(const void *pattern, size_t patternSize,
+        std::shared_ptr<Device> device) {
+    if(!patternSize || _size % patternSize)
+        throw BufferCopyError("The size isn't a multiple of the pattern.");
+
+    auto &owner = root();
+    std::lock_guard<std::recursive_mutex> lock(owner._mutex);
+    if(!device)
+        device = lastDevice();
+    if(!device)
+        throw BufferEmptyError("No device used the buffer yet.");
+
+    // The fill overwrites the sources of this buffer, but not the parts of
+    // the root buffer's source outside a view.
+    unmap();
     if(hasCopySource())
-        makeCopy(_device->JNIEnv());
+        releaseCopySources();
+    auto &replica = owner.replica(device);
+    flushSources(replica);
+    owner.waitTransfer(replica);
+
+    auto queue = device->clQueue();
+    ProfiledCommand write(device->id(), "write");
+    int err = clEnqueueWriteBuffer(queue, replica.mem, CL_TRUE, _offset,
+            patternSize, pattern, 0, nullptr, write.event());
+    if(err < 0)
+        throw BufferCopyError(std::to_string(err));
+
+    for(size_t filled = patternSize; filled < _size;) {
+        size_t length = std::min(filled, _size - filled);
+        ProfiledCommand copy(device->id(), "copy");
+        err = clEnqueueCopyBuffer(queue, replica.mem, replica.mem, _offset,
+                _offset + filled, length, 0, nullptr, copy.event());
+        if(err < 0)
+            throw BufferCopyError(std::to_string(err));
+        filled += length;
+    }
+
+    owner.markWritten(replica, _offset, _offset + _size);
+    _device = device;
+}
+
+void Buffer::setHostShadow(bool enabled) {
+    auto &owner = root();
+    std::lock_guard<std::recursive_mutex> lock(owner._mutex);
+    owner._hostShadow = enabled;
+    if(enabled)
+        return;
+
+    // Only the evicted ranges, which no device has, are kept.
+    for(auto &it : owner._replicas) {
+        for(auto &range : it.second.valid)
+            removeRange(owner._hostValid, range.first, range.second);
+    }
+    if(owner._hostCopy && owner._hostValid.empty()) {
+        free(owner._hostCopy);
+        owner._hostCopy = nullptr;
+    }
+}
+
+const void *Buffer::hostData() {
+    auto &owner = root();
+    std::lock_guard<std::recursive_mutex> lock(owner._mutex);
+    owner._hostShadow = true;
+    if((hasCopySource() || owner.hasCopySource()) && lastDevice())
+        flushSources(owner.replica(lastDevice()));
+
+    owner.updateShadow(_offset, _offset + _size, lastDevice());
+    return (char *) owner._hostCopy + _offset;
+}
+
+std::shared_ptr<Event> Buffer::copyToAsync(void *host) {
+    auto &owner = root();
+    std::lock_guard<std::recursive_mutex> lock(owner._mutex);
+    if((hasCopySource() || owner.hasCopySource()) && lastDevice())
+        flushSources(owner.replica(lastDevice()));
+
+    auto replica = owner.readReplica(_offset, _offset + _size, lastDevice());
+    if(!replica)
+        throw BufferEmptyError("No device has the contents of the buffer.");
+    owner.waitTransfer(*replica);
+
+    auto marker = owner.computeMarker(*replica);
+    _cl_event *event;
+
+    int err = clEnqueueReadBuffer(replica->device->clTransferQueue(),
+            replica->mem, CL_FALSE, _offset, _size, host, 1, &marker, &event);
+    clReleaseEvent(marker);
+    if(err < 0)
+        throw BufferCopyError(std::to_string(err));
+
+    clRetainEvent(event);
+    replica->transferEvent = event;
+
+    // Kernels wait on the event from the compute queue, which only sees it
+    // complete once the transfer queue submitted it.
+    err = clFlush(replica->device->clTransferQueue());
+    if(err < 0) {
+        clReleaseEvent(event);
+        throw BufferCopyError(std::to_string(err));
+    }
+
+    profileAsync(replica->device->id(), "read", event);
+    return std::shared_ptr<Event>(new Event(event));
+}
+
+std::shared_ptr<Event> Buffer::setSourceAsync(void *host,
+        std::shared_ptr<Device> device) {
+    auto &owner = root();
+    std::lock_guard<std::recursive_mutex> lock(owner._mutex);
+    if(!device)
+        device = lastDevice();
+    if(!device)
+        throw BufferEmptyError("No device used the buffer yet.");
+
+    // Sources saved before this call and other copies are older than the new
+    // contents, so they are discarded without being copied.
+    unmap();
+    _copyPtr = nullptr;
+    if(hasCopySource())
+        releaseCopySources();
+
+    auto &replica = owner.replica(device);
+    owner.waitTransfer(replica);
+
+    // The source of the root buffer also covers the rest of it.
+    if(_parent && owner.hasCopySource())
+        owner.makeCopy(replica);
 
-    return _mem;
+    owner.markWritten(replica, _offset, _offset + _size);
+    auto marker = owner.computeMarker(replica);
+    _cl_event *event;
+
+    int err = clEnqueueWriteBuffer(device->clTransferQueue(), replica.mem,
+            CL_FALSE, _offset, _size, host, 1, &marker, &event);
+    clReleaseEvent(marker);
+    if(err < 0)
+        throw BufferCopyError(std::to_string(err));
+
+    clRetainEvent(event);
+    replica.transferEvent = event;
+
+    // Kernels wait on the event too, see copyToAsync().
+    err = clFlush(device->clTransferQueue());
+    if(err < 0) {
+        clReleaseEvent(event);
+        throw BufferCopyError(std::to_string(err));
+    }
+
+    profileAsync(device->id(), "write", event);
+    _device = device;
+    return std::shared_ptr<Event>(new Event(event));
+}
+
+void Buffer::prefetch(std::shared_ptr<Device> device) {
+    auto &owner = root();
+    std::lock_guard<std::recursive_mutex> lock(owner._mutex);
+    unmap();
+
+    // Only an empty buffer has no source, no copies and no evicted data.
+    if(!hasCopySource() && !owner.hasCopySource() && owner._replicas.empty()
+            && owner._hostValid.empty())
+        throw BufferEmptyError("No device has the contents of the buffer.");
+
+    auto &replica = owner.replica(device);
+    replica.lastTask = device->currentTask();
+    device->touchMemory(&owner);
+    flushSources(replica);
+    owner.prefetchRanges(replica, _offset, _offset + _size);
 }
 
-void Buffer::createMemoryObject(std::shared_ptr<Device> newDevice, bool copyOld) {
+std::vector<std::shared_ptr<Device>> Buffer::residentOn() {
+    auto &owner = root();
+    std::lock_guard<std::recursive_mutex> lock(owner._mutex);
+    std::vector<std::shared_ptr<Device>> devices;
+
+    // Sources are newer than all the copies.
+    if(hasCopySource() || owner.hasCopySource())
+        return devices;
+
+    for(auto &it : owner._replicas) {
+        if(missingRanges(it.second.valid, _offset, _offset + _size).empty())
+            devices.push_back(it.second.device);
+    }
+
+    return devices;
+}
+
+void *Buffer::map() {
+    auto &owner = root();
+    std::lock_guard<std::recursive_mutex> lock(owner._mutex);
+    auto device = lastDevice();
+    if(!device)
+        throw BufferEmptyError("No device used the buffer yet.");
+    if(_mapped)
+        return _mapped;
+
+    auto &replica = owner.replica(device);
+    owner.waitTransfer(replica);
+    flushSources(replica);
+    owner.validate(replica, _offset, _offset + _size);
+    owner.markWritten(replica, _offset, _offset + _size);
+    _device = device;
     int err;
-    auto newMem = clCreateBuffer(newDevice->clContext(), CL_MEM_READ_WRITE,
-            _size, nullptr, &err);
+
+    ProfiledCommand map(device->id(), "map");
+    _mapped = clEnqueueMapBuffer(device->clQueue(), replica.mem, CL_TRUE,
+            CL_MAP_READ | CL_MAP_WRITE, _offset, _size, 0, nullptr,
+            map.event(), &err);
+    if(err < 0) {
+        _mapped = nullptr;
+        throw BufferCopyError(std::to_string(err));
+    }
+
+    return _mapped;
+}
+
+void Buffer::unmap() {
+    auto &owner = root();
+    std::lock_guard<std::recursive_mutex> lock(owner._mutex);
+    if(!_mapped)
+        return;
+
+    // The buffer is mapped on _device, which only changes after unmapping.
+    clEnqueueUnmapMemObject(_device->clQueue(),
+            owner._replicas.at(_device->id()).mem, _mapped, 0, nullptr,
+            nullptr);
+    _mapped = nullptr;
+
+    // Reads while mapped may have put the old contents in the host shadow.
+    owner.invalidateHost(_offset, _offset + _size);
+}
+
+void Buffer::kernelWrote(size_t begin, size_t end) {
+    auto &owner = root();
+    std::lock_guard<std::recursive_mutex> lock(owner._mutex);
+    owner.invalidateHost(_offset + begin, _offset + end);
+}
+
+std::shared_ptr<Buffer> Buffer::view(size_t offset, size_t length) {
+    if(offset > _size || length > _size - offset)
+        throw BufferConstructionError("The view doesn't fit in the buffer.");
+    if(_parent)
+        return _parent->view(_offset + offset, length);
+
+    // I don't use std::make_shared here because the view constructor is private.
+    auto view = std::shared_ptr<Buffer>(new Buffer(shared_from_this(), offset,
+                length));
+
+    // Evicting a copy must also release the sub-buffers of the views.
+    std::lock_guard<std::recursive_mutex> lock(_mutex);
+    _views.erase(std::remove_if(_views.begin(), _views.end(),
+                [] (std::weak_ptr<Buffer> &view) { return view.expired(); }),
+            _views.end());
+    _views.push_back(view);
+
+    return view;
+}
+
+_cl_mem *Buffer::clMem(std::shared_ptr<Device> device, Access access) {
+    return clMem(device, access, 0, _size);
+}
+
+_cl_mem *Buffer::clMem(std::shared_ptr<Device> device, Access access,
+        size_t begin, size_t end) {
+    auto &owner = root();
+    std::lock_guard<std::recursive_mutex> lock(owner._mutex);
+    unmap();
+
+    auto &replica = owner.replica(device, access);
+    replica.lastTask = device->currentTask();
+    device->touchMemory(&owner);
+    owner.waitTransfer(replica);
+    if(!allowsAccess(replica.flags, access))
+        owner.reallocate(replica);
+
+    // The kernel overwrites what the source would copy, unless other devices
+    // write the rest of the buffer.
+    if(access == WriteOnly && !begin && end == _size && hasCopySource())
+        releaseCopySources();
+
+    flushSources(replica);
+    if(access != WriteOnly)
+        owner.validate(replica, _offset + begin, _offset + end);
+    if(access != ReadOnly)
+        owner.markWritten(replica, _offset + begin, _offset + end);
+
+    _device = device;
+    return _parent ? subBuffer(replica) : replica.mem;
+}
+
+void Buffer::flushSources(Replica &replica) {
+    auto &owner = root();
+    if(!hasCopySource() && !owner.hasCopySource())
+        return;
+    owner.waitTransfer(replica);
+
+    // The host has the newest data, so outdated copies aren't moved. The
+    // source of a view is newer than the source of its root buffer.
+    if(owner.hasCopySource())
+        owner.makeCopy(replica);
+    if(_parent && hasCopySource())
+        makeCopy(replica);
+}
+
+_cl_mem *Buffer::subBuffer(Replica &replica) {
+    // Sub-buffers can't be created on the sub-buffers of the memory arena.
+    _cl_mem *parent;
+    int err = clGetMemObjectInfo(replica.mem, CL_MEM_ASSOCIATED_MEMOBJECT,
+            sizeof(parent), &parent, nullptr);
     if(err < 0)
         throw BufferConstructionError(std::to_string(err));
+    if(parent)
+        root().reallocate(replica);
+
+    auto it = _subBuffers.find(replica.device->id());
+    if(it != _subBuffers.end()) {
+        if(it->second.first == replica.mem)
+            return it->second.second;
+
+        clReleaseMemObject(it->second.second);
+        _subBuffers.erase(it);
+    }
+
+    cl_buffer_region region = { _offset, _size };
+    auto flags = replica.flags
+        & (CL_MEM_READ_WRITE | CL_MEM_WRITE_ONLY | CL_MEM_READ_ONLY);
+    auto mem = clCreateSubBuffer(replica.mem, flags,
+            CL_BUFFER_CREATE_TYPE_REGION, &region, &err);
+    if(err < 0)
+        throw BufferConstructionError(std::to_string(err));
+
+    _subBuffers.insert(std::make_pair(replica.device->id(),
+                SubBuffer(replica.mem, mem)));
+    return mem;
+}
+
+Buffer::Replica &Buffer::replica(std::shared_ptr<Device> &device,
+        Access access) {
+    auto it = _replicas.find(device->id());
+    if(it != _replicas.end())
+        return it->second;
+
+    Replica replica;
+    replica.device = device;
+    replica.mem = adoptHostSource(device, replica.flags);
+    if(replica.mem)
+        addRange(replica.valid, 0, _size);
+    else
+        replica.mem = allocate(device, access, replica.flags);
+    replica.transferEvent = nullptr;
+    replica.lastTask = device->currentTask();
+
+    // The host source is newer than the other copies.
+    if(replica.valid.size())
+        for(auto &it : _replicas)
+            removeRange(it.second.valid, 0, _size);
+
+    return _replicas.insert(std::make_pair(device->id(), replica)).first->second;
+}
 
-    // If there is a memory object already, do a copy and delete the old mem.
-    if(copyOld && _mem) {
-        void *oldData = clEnqueueMapBuffer(_device->clQueue(), _mem, CL_TRUE,
-                CL_MAP_READ, 0, _size, 0, nullptr, nullptr, &err);
+void Buffer::reallocate(Replica &replica) {
+    uint64_t flags;
+    auto mem = allocate(replica.device, ReadWrite, flags);
+
+    // Both objects are on the same context, so the device makes the copy.
+    for(auto &range : replica.valid) {
+        ProfiledCommand copy(replica.device->id(), "copy");
+        int err = clEnqueueCopyBuffer(replica.device->clQueue(), replica.mem,
+                mem, range.first, range.first, range.second - range.first, 0,
+                nullptr, copy.event());
+        if(err < 0) {
+            deallocate(mem, flags, replica.device);
+            throw BufferCopyError(std::to_string(err));
+        }
+    }
+
+    deallocate(replica.mem, replica.flags, replica.device);
+    replica.mem = mem;
+    replica.flags = flags;
+}
+
+void Buffer::validate(Replica &replica, size_t begin, size_t end) {
+    for(auto &it : _replicas) {
+        auto &from = it.second;
+        if(&from == &replica)
+            continue;
+
+        // Copy the parts of each missing range that this copy has.
+        for(auto &missing : missingRanges(replica.valid, begin, end)) {
+            auto range = from.valid.upper_bound(missing.first);
+            if(range != from.valid.begin())
+                --range;
+
+            for(; range != from.valid.end() && range->first < missing.second;
+                    ++range) {
+                size_t copyBegin = std::max(range->first, missing.first);
+                size_t copyEnd = std::min(range->second, missing.second);
+                if(copyBegin < copyEnd) {
+                    copyRange(from, replica, copyBegin, copyEnd);
+                    addRange(replica.valid, copyBegin, copyEnd);
+                }
+            }
+        }
+    }
+
+    restore(replica, begin, end);
+}
+
+void Buffer::prefetchRanges(Replica &replica, size_t begin, size_t end) {
+    // Blocks of the missing ranges, read from where they are up to date.
+    std::vector<std::pair<size_t, size_t>> ranges;
+    std::vector<char *> blocks;
+    auto readBlock = [&] (Replica *from, size_t copyBegin, size_t copyEnd) {
+        auto block = (char *) malloc(copyEnd - copyBegin);
+        if(!block)
+            throw BufferCopyError("Failed to allocate the prefetch block.");
+        ranges.push_back(std::make_pair(copyBegin, copyEnd));
+        blocks.push_back(block);
+        if(!from) {
+            memcpy(block, (char *) _hostCopy + copyBegin, copyEnd - copyBegin);
+            return;
+        }
+
+        // Devices have their own contexts, so the host waits for the read.
+        waitTransfer(*from);
+        ProfiledCommand read(from->device->id(), "read");
+        int err = clEnqueueReadBuffer(from->device->clQueue(), from->mem,
+                CL_TRUE, copyBegin, copyEnd - copyBegin, block, 0, nullptr,
+                read.event());
         if(err < 0)
             throw BufferCopyError(std::to_string(err));
-        void *newData = clEnqueueMapBuffer(newDevice->clQueue(), newMem, CL_TRUE,
-                CL_MAP_WRITE, 0, _size, 0, nullptr, nullptr, &err);
+    };
+
+    // Each missing byte is taken from the first place that has it.
+    Ranges pending = missingRanges(replica.valid, begin, end);
+    auto gather = [&] (Replica *from, const Ranges &valid) {
+        for(auto &missing : Ranges(pending)) {
+            auto range = valid.upper_bound(missing.first);
+            if(range != valid.begin())
+                --range;
+
+            for(; range != valid.end() && range->first < missing.second;
+                    ++range) {
+                size_t copyBegin = std::max(range->first, missing.first);
+                size_t copyEnd = std::min(range->second, missing.second);
+                if(copyBegin >= copyEnd)
+                    continue;
+
+                readBlock(from, copyBegin, copyEnd);
+                removeRange(pending, copyBegin, copyEnd);
+            }
+        }
+    };
+
+    try {
+        for(auto &it : _replicas) {
+            if(&it.second != &replica)
+                gather(&it.second, it.second.valid);
+        }
+        gather(nullptr, _hostValid);
+    }
+    catch(...) {
+        for(auto block : blocks)
+            free(block);
+        throw;
+    }
+
+    // The missing ranges aren't used by the kernels queued on the device, so
+    // the writes don't wait for them. The transfer queue runs them after the
+    // transfer of the copy that may still be pending.
+    auto queue = replica.device->clTransferQueue();
+    _cl_event *last = nullptr;
+    int err = 0;
+    for(size_t i = 0; i < blocks.size(); ++i) {
+        auto &range = ranges[i];
+        _cl_event *event = nullptr;
+        if(err >= 0)
+            err = clEnqueueWriteBuffer(queue, replica.mem, CL_FALSE,
+                    range.first, range.second - range.first, blocks[i], 0,
+                    nullptr, &event);
+        if(err < 0 || clSetEventCallback(event, CL_COMPLETE,
+                    freeWrittenBlock, blocks[i]) < 0) {
+            if(event)
+                clWaitForEvents(1, &event);
+            free(blocks[i]);
+        }
+        if(err < 0)
+            continue;
+
+        profileAsync(replica.device->id(), "write", event);
+        addRange(replica.valid, range.first, range.second);
+        if(last)
+            clReleaseEvent(last);
+        last = event;
+    }
+
+    if(last) {
+        if(replica.transferEvent)
+            clReleaseEvent(replica.transferEvent);
+        replica.transferEvent = last;
+    }
+
+    // Kernels wait on the transfer from the compute queue.
+    int flushErr = clFlush(queue);
+    if(err >= 0)
+        err = flushErr;
+    if(err < 0)
+        throw BufferCopyError(std::to_string(err));
+}
+
+void Buffer::markWritten(Replica &replica, size_t begin, size_t end) {
+    for(auto &it : _replicas)
+        removeRange(it.second.valid, begin, end);
+    addRange(replica.valid, begin, end);
+    invalidateHost(begin, end);
+}
+
+void Buffer::invalidateHost(size_t begin, size_t end) {
+    removeRange(_hostValid, begin, end);
+    if(_hostCopy && _hostValid.empty() && !_hostShadow) {
+        free(_hostCopy);
+        _hostCopy = nullptr;
+    }
+}
+
+Buffer::Replica *Buffer::readReplica(size_t begin, size_t end,
+        std::shared_ptr<Device> &preferred) {
+    auto hasData = [&] (Replica &replica) {
+        auto missing = missingRanges(replica.valid, begin, end);
+        return missing.empty() || missing.begin()->first != begin
+            || missing.begin()->second != end;
+    };
+
+    Replica *replica = nullptr;
+    if(preferred) {
+        auto it = _replicas.find(preferred->id());
+        if(it != _replicas.end() && hasData(it->second))
+            replica = &it->second;
+    }
+    for(auto it = _replicas.begin(); !replica && it != _replicas.end(); ++it) {
+        if(hasData(it->second))
+            replica = &it->second;
+    }
+
+    // Evicted data is brought back to the preferred device.
+    auto hostMissing = missingRanges(_hostValid, begin, end);
+    if(!replica && preferred && (hostMissing.empty()
+                || hostMissing.begin()->first != begin
+                || hostMissing.begin()->second != end))
+        replica = &this->replica(preferred);
+
+    if(replica)
+        validate(*replica, begin, end);
+    return replica;
+}
+
+std::pair<size_t, size_t> Buffer::rectSpan(const Rect &rect) {
+    if(!rect.width || !rect.height)
+        return std::make_pair(_offset, _offset);
+
+    size_t end = (rect.y + rect.height - 1) * rect.rowPitch + rect.x
+        + rect.width;
+    if(rect.x + rect.width > rect.rowPitch || end > _size)
+        throw BufferCopyError("The region doesn't fit in the buffer.");
+
+    return std::make_pair(_offset + rect.y * rect.rowPitch + rect.x,
+            _offset + end);
+}
+
+void Buffer::copyRange(Replica &from, Replica &to, size_t begin, size_t end) {
+    waitTransfer(from);
+    waitTransfer(to);
+
+    int err;
+    size_t size = end - begin;
+    ProfiledCommand fromMap(from.device->id(), "map");
+    void *fromData = clEnqueueMapBuffer(from.device->clQueue(), from.mem,
+            CL_TRUE, CL_MAP_READ, begin, size, 0, nullptr, fromMap.event(),
+            &err);
+    if(err < 0)
+        throw BufferCopyError(std::to_string(err));
+    ProfiledCommand toMap(to.device->id(), "map");
+    void *toData = clEnqueueMapBuffer(to.device->clQueue(), to.mem, CL_TRUE,
+            CL_MAP_WRITE, begin, size, 0, nullptr, toMap.event(), &err);
+    if(err < 0)
+        throw BufferCopyError(std::to_string(err));
+
+    TransferEngine::instance().copy(toData, fromData, size);
+
+    clEnqueueUnmapMemObject(from.device->clQueue(), from.mem, fromData, 0,
+            nullptr, nullptr);
+    clEnqueueUnmapMemObject(to.device->clQueue(), to.mem, toData, 0, nullptr,
+            nullptr);
+}
+
+void Buffer::addRange(Ranges &ranges, size_t begin, size_t end) {
+    if(begin >= end)
+        return;
+
+    // Merge with the ranges that overlap or touch the new one.
+    auto it = ranges.upper_bound(begin);
+    if(it != ranges.begin() && std::prev(it)->second >= begin)
+        --it;
+
+    while(it != ranges.end() && it->first <= end) {
+        begin = std::min(begin, it->first);
+        end = std::max(end, it->second);
+        it = ranges.erase(it);
+    }
+
+    ranges.insert(std::make_pair(begin, end));
+}
+
+void Buffer::removeRange(Ranges &ranges, size_t begin, size_t end) {
+    if(begin >= end)
+        return;
+
+    auto it = ranges.upper_bound(begin);
+    if(it != ranges.begin())
+        --it;
+
+    while(it != ranges.end() && it->first < end) {
+        size_t rangeBegin = it->first;
+        size_t rangeEnd = it->second;
+        if(rangeEnd <= begin) {
+            ++it;
+            continue;
+        }
+
+        // Keep the parts of the range outside of the removed one.
+        it = ranges.erase(it);
+        if(rangeBegin < begin)
+            ranges.insert(std::make_pair(rangeBegin, begin));
+        if(rangeEnd > end) {
+            ranges.insert(std::make_pair(end, rangeEnd));
+            break;
+        }
+    }
+}
+
+Buffer::Ranges Buffer::missingRanges(const Ranges &ranges, size_t begin,
+        size_t end) {
+    Ranges missing;
+    size_t position = begin;
+
+    auto it = ranges.upper_bound(begin);
+    if(it != ranges.begin())
+        --it;
+
+    for(; it != ranges.end() && it->first < end; ++it) {
+        if(it->second <= position)
+            continue;
+        if(it->first > position)
+            missing.insert(std::make_pair(position, it->first));
+        position = it->second;
+    }
+    if(position < end)
+        missing.insert(std::make_pair(position, end));
+
+    return missing;
+}
+
+_cl_mem *Buffer::allocate(std::shared_ptr<Device> &device, Access access,
+        uint64_t &flags) {
+    switch(access) {
+    case ReadOnly: flags = CL_MEM_READ_ONLY; break;
+    case WriteOnly: flags = CL_MEM_WRITE_ONLY; break;
+    default: flags = CL_MEM_READ_WRITE; break;
+    }
+
+    if(_allocation == HostVisibleMemory && device->hostUnifiedMemory()) {
+        // Page alignment makes zero-copy work on all unified memory devices.
+        size_t align = std::max(device->memBaseAddrAlign(), (size_t) 4096);
+        void *host;
+        if(posix_memalign(&host, align, (_size + align - 1) / align * align))
+            throw BufferConstructionError("Failed to allocate host storage.");
+
+        int err;
+        flags |= CL_MEM_USE_HOST_PTR;
+        auto mem = clCreateBuffer(device->clContext(), flags, _size, host, &err);
+        if(err < 0) {
+            free(host);
+            throw BufferConstructionError(std::to_string(err));
+        }
+
+        err = clSetMemObjectDestructorCallback(mem, freeHostStorage, host);
+        if(err < 0) {
+            clReleaseMemObject(mem);
+            free(host);
+            throw BufferConstructionError(std::to_string(err));
+        }
+
+        return mem;
+    }
+
+    if(_allocation == HostVisibleMemory)
+        flags |= CL_MEM_ALLOC_HOST_PTR;
+
+    device->reserveMemory(this, _size);
+    try {
+        try {
+            return device->memoryPool().acquire(_size, flags, _views.empty());
+        }
+        catch(MemoryPoolError &) {
+            // The budget may be above what the device really has free.
+            device->reclaimMemory(this);
+            return device->memoryPool().acquire(_size, flags, _views.empty());
+        }
+    }
+    catch(MemoryPoolError &e) {
+        device->releaseMemory(this, _size);
+        throw BufferConstructionError(e.what());
+    }
+}
+
+void Buffer::deallocate(_cl_mem *mem, uint64_t flags,
+        std::shared_ptr<Device> &device) {
+    // Host storage belongs to a single buffer, so it can't be pooled.
+    if(flags & CL_MEM_USE_HOST_PTR) {
+        clReleaseMemObject(mem);
+    }
+    else {
+        device->memoryPool().release(mem, _size, flags);
+        device->releaseMemory(this, _size);
+    }
+}
+
+bool Buffer::allowsAccess(uint64_t flags, Access access) {
+    if(flags & CL_MEM_READ_ONLY)
+        return access == ReadOnly;
+    if(flags & CL_MEM_WRITE_ONLY)
+        return access == WriteOnly;
+    return true;
+}
+
+bool Buffer::evictable(Device &device) {
+    auto it = _replicas.find(device.id());
+    if(it == _replicas.end() || _pins)
+        return false;
+    auto &replica = it->second;
+    if(replica.lastTask == device.currentTask()
+            || replica.flags & CL_MEM_USE_HOST_PTR)
+        return false;
+
+    // Mapped pointers would dangle.
+    if(_mapped && _device->id() == device.id())
+        return false;
+    for(auto &weakView : _views) {
+        auto view = weakView.lock();
+        if(view && view->_mapped && view->_device->id() == device.id())
+            return false;
+    }
+
+    return true;
+}
+
+bool Buffer::evict(Device &device) {
+    auto it = _replicas.find(device.id());
+    auto &replica = it->second;
+    std::vector<std::shared_ptr<Buffer>> views;
+    for(auto &weakView : _views) {
+        auto view = weakView.lock();
+        if(view)
+            views.push_back(view);
+    }
+
+    // Only the ranges that no other copy has need to go to the host.
+    Ranges unique = replica.valid;
+    for(auto &other : _replicas) {
+        if(&other.second == &replica)
+            continue;
+        for(auto &range : other.second.valid)
+            removeRange(unique, range.first, range.second);
+    }
+    for(auto &range : _hostValid)
+        removeRange(unique, range.first, range.second);
+
+    if(!unique.empty()) {
+        if(!_hostCopy && !(_hostCopy = malloc(_size)))
+            return false;
+
+        waitTransfer(replica);
+        for(auto &range : unique) {
+            ProfiledCommand read(device.id(), "read");
+            int err = clEnqueueReadBuffer(device.clQueue(), replica.mem,
+                    CL_TRUE, range.first, range.second - range.first,
+                    (char *) _hostCopy + range.first, 0, nullptr,
+                    read.event());
+            if(err < 0)
+                return false;
+            addRange(_hostValid, range.first, range.second);
+        }
+    }
+
+    // The sub-buffers keep the memory object alive.
+    for(auto &view : views) {
+        auto subBuffer = view->_subBuffers.find(device.id());
+        if(subBuffer != view->_subBuffers.end()) {
+            clReleaseMemObject(subBuffer->second.second);
+            view->_subBuffers.erase(subBuffer);
+        }
+    }
+
+    // The memory object can't be reused while a transfer uses it. The device
+    // accounts the freed memory itself, and the pool would keep it.
+    if(replica.transferEvent) {
+        clWaitForEvents(1, &replica.transferEvent);
+        clReleaseEvent(replica.transferEvent);
+    }
+    if(!device.memoryPool().arena().release(replica.mem))
+        clReleaseMemObject(replica.mem);
+    _replicas.erase(it);
+    return true;
+}
+
+void Buffer::restore(Replica &replica, size_t begin, size_t end) {
+    if(_hostValid.empty())
+        return;
+
+    for(auto &missing : missingRanges(replica.valid, begin, end)) {
+        auto range = _hostValid.upper_bound(missing.first);
+        if(range != _hostValid.begin())
+            --range;
+
+        for(; range != _hostValid.end() && range->first < missing.second;
+                ++range) {
+            size_t copyBegin = std::max(range->first, missing.first);
+            size_t copyEnd = std::min(range->second, missing.second);
+            if(copyBegin >= copyEnd)
+                continue;
+
+            waitTransfer(replica);
+            ProfiledCommand write(replica.device->id(), "write");
+            int err = clEnqueueWriteBuffer(replica.device->clQueue(),
+                    replica.mem, CL_TRUE, copyBegin, copyEnd - copyBegin,
+                    (char *) _hostCopy + copyBegin, 0, nullptr, write.event());
+            if(err < 0)
+                throw BufferCopyError(std::to_string(err));
+            addRange(replica.valid, copyBegin, copyEnd);
+        }
+    }
+}
+
+void Buffer::updateShadow(size_t begin, size_t end,
+        std::shared_ptr<Device> &preferred) {
+    auto missing = missingRanges(_hostValid, begin, end);
+    if(missing.empty())
+        return;
+
+    if(!_hostCopy && !(_hostCopy = malloc(_size)))
+        throw BufferCopyError("Failed to allocate the host shadow.");
+
+    auto replica = readReplica(begin, end, preferred);
+    if(!replica)
+        throw BufferEmptyError("No device has the contents of the buffer.");
+    waitTransfer(*replica);
+
+    for(auto &range : missing) {
+        ProfiledCommand read(replica->device->id(), "read");
+        int err = clEnqueueReadBuffer(replica->device->clQueue(), replica->mem,
+                CL_TRUE, range.first, range.second - range.first,
+                (char *) _hostCopy + range.first, 0, nullptr, read.event());
         if(err < 0)
             throw BufferCopyError(std::to_string(err));
+        addRange(_hostValid, range.first, range.second);
+    }
+}
+
+void Buffer::waitTransfer(Replica &replica) {
+    if(!replica.transferEvent)
+        return;
+
+    int err = clEnqueueWaitForEvents(replica.device->clQueue(), 1,
+            &replica.transferEvent);
+    if(err < 0)
+        throw BufferCopyError(std::to_string(err));
 
-        memcpy(newData, oldData, _size);
+    clReleaseEvent(replica.transferEvent);
+    replica.transferEvent = nullptr;
+}
 
-        clEnqueueUnmapMemObject(_device->clQueue(), _mem, oldData, 0, nullptr, nullptr);
-        _device->finish();
-        clEnqueueUnmapMemObject(newDevice->clQueue(), newMem, newData, 0, nullptr, nullptr);
+_cl_event *Buffer::computeMarker(Replica &replica) {
+    _cl_event *marker;
+    int err = clEnqueueMarker(replica.device->clQueue(), &marker);
+    if(err < 0)
+        throw BufferCopyError(std::to_string(err));
 
-        clReleaseMemObject(_mem);
+    // Other queues only see the marker complete once it was submitted.
+    err = clFlush(replica.device->clQueue());
+    if(err < 0) {
+        clReleaseEvent(marker);
+        throw BufferCopyError(std::to_string(err));
     }
 
-    _mem = newMem;
-    _device = newDevice;
+    return marker;
+}
+
+_cl_mem *Buffer::adoptHostSource(std::shared_ptr<Device> &device,
+        uint64_t &flags) {
+    // A newer pointer source or a view's buffer would make the memory stale.
+    void *host = _copyFile.address ? _copyFile.data : _copyDirect;
+    if(!host || _copyPtr || _parent || !device->hostUnifiedMemory()
+            || (uintptr_t) host % device->memBaseAddrAlign())
+        return nullptr;
+
+    // The memory object keeps the ByteBuffer alive, which needs the VM.
+    if(!_copyFile.address && !_vm)
+        return nullptr;
+
+    int err;
+    flags = CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR;
+    auto mem = clCreateBuffer(device->clContext(), flags, _size, host, &err);
+    if(err < 0)
+        return nullptr;
+
+    if(!_copyFile.address) {
+        auto direct = new DirectStorage(_vm, _copyDirectRef);
+        err = clSetMemObjectDestructorCallback(mem, releaseDirectStorage,
+                direct);
+        if(err < 0) {
+            delete direct;
+            clReleaseMemObject(mem);
+            return nullptr;
+        }
+
+        // The memory object owns the reference now.
+        _copyDirect = nullptr;
+        _copyDirectRef = nullptr;
+        return mem;
+    }
+
+    auto region = new std::pair<void *, size_t>(_copyFile.address,
+            _copyFile.length);
+    err = clSetMemObjectDestructorCallback(mem, unmapHostStorage, region);
+    if(err < 0) {
+        delete region;
+        clReleaseMemObject(mem);
+        return nullptr;
+    }
+
+    // The memory object owns the pages now.
+    _copyFile.address = nullptr;
+    return mem;
+}
+
+void Buffer::releaseFileSource() {
+    if(_copyFile.address) {
+        munmap(_copyFile.address, _copyFile.length);
+        _copyFile.address = nullptr;
+    }
 }
 
 void Buffer::releaseCopySources(JNIEnv *env) {
     if(_copyPtr) {
         _copyPtr = nullptr;
     }
+    releaseFileSource();
+    _copyDirect = nullptr;
+    if(_copyDirectRef) {
+        env->DeleteGlobalRef(_copyDirectRef);
+        _copyDirectRef = nullptr;
+    }
     if(_copyArray) {
         env->DeleteGlobalRef(_copyArray);
         _copyArray = nullptr;
@@ -136,43 +1429,87 @@ void Buffer::releaseCopySources(JNIEnv *env) {
     }
 }
 
-void Buffer::makeCopy(JNIEnv *env) {
+void Buffer::releaseCopySources() {
+    bool java = _copyDirectRef || _copyArray || _copyBitmap;
+    ThreadEnv threadEnv(java ? _vm : nullptr);
+    if(java && !threadEnv.get())
+        throw BufferCopyError("Failed to get the JNIEnv of the thread.");
+
+    releaseCopySources(threadEnv.get());
+}
+
+void Buffer::makeCopy(Replica &replica) {
+    // Only Java sources need the thread attached to the VM.
+    bool java = _copyArray || _copyBitmap || _copyDirectRef;
+    ThreadEnv threadEnv(java ? _vm : nullptr);
+    auto env = threadEnv.get();
+    if(java && !env)
+        throw BufferCopyError("Failed to get the JNIEnv of the thread.");
+
     // _copyPtr has preference because copyFrom() doesn't call releaseCopySources(),
     // so _copyArray and _copyBitmap may still have references to clear.
     if(_copyPtr) {
-        makeCopyFrom(_copyPtr);
+        makeCopyFrom(_copyPtr, replica);
+    }
+    else if(_copyFile.address) {
+        makeCopyFrom(_copyFile.data, replica);
+    }
+    else if(_copyDirect) {
+        makeCopyFrom(_copyDirect, replica);
     }
     else if(_copyArray) {
-        void *ptr = env->GetPrimitiveArrayCritical(_copyArray, nullptr);
-        if(!ptr)
-            throw BufferCopyError("Failed to get primitive array.");
+        // Java data is only held while it is copied to the staging ring.
+        stageCopy([&] (void *staging) {
+            void *ptr = env->GetPrimitiveArrayCritical(_copyArray, nullptr);
+            if(!ptr)
+                throw BufferCopyError("Failed to get primitive array.");
 
-        makeCopyFrom(ptr);
+            TransferEngine::instance().copy(staging, ptr, _size);
 
-        env->ReleasePrimitiveArrayCritical(_copyArray, ptr, 0);
+            env->ReleasePrimitiveArrayCritical(_copyArray, ptr, JNI_ABORT);
+        }, replica);
     }
     else { // _copyBitmap
-        void *ptr;
-        int err = AndroidBitmap_lockPixels(env, _copyBitmap, &ptr);
-        if(err < 0)
-            throw BufferCopyError("Failed to lock android bitmap's pixels.");
+        stageCopy([&] (void *staging) {
+            void *ptr;
+            int err = AndroidBitmap_lockPixels(env, _copyBitmap, &ptr);
+            if(err < 0)
+                throw BufferCopyError("Failed to lock android bitmap's pixels.");
 
-        makeCopyFrom(ptr);
+            TransferEngine::instance().copy(staging, ptr, _size);
 
-        AndroidBitmap_unlockPixels(env, _copyBitmap);
+            AndroidBitmap_unlockPixels(env, _copyBitmap);
+        }, replica);
     }
 
     releaseCopySources(env);
+    root().markWritten(replica, _offset, _offset + _size);
+}
+
+void Buffer::stageCopy(const std::function<void (void *)> &fill,
+        Replica &replica) {
+    // The replica is referenced until the copy is queued, so the buffer
+    // can't be evicted to make room for the staging slot.
+    try {
+        replica.device->stagingRing().stage(_size, &root(), replica.mem,
+                _offset, fill);
+    }
+    catch(StagingRingError &e) {
+        throw BufferCopyError(e.what());
+    }
 }
 
-void Buffer::makeCopyFrom(void *host) {
+void Buffer::makeCopyFrom(void *host, Replica &replica) {
     int err;
 
-    void *data = clEnqueueMapBuffer(_device->clQueue(), _mem, CL_TRUE,
-            CL_MAP_WRITE, 0, _size, 0, nullptr, nullptr, &err);
+    ProfiledCommand map(replica.device->id(), "map");
+    void *data = clEnqueueMapBuffer(replica.device->clQueue(), replica.mem,
+            CL_TRUE, CL_MAP_WRITE, _offset, _size, 0, nullptr, map.event(),
+            &err);
     if(err < 0)
         throw BufferCopyError(std::to_string(err));
 
-    memcpy(data, host, _size);
-    clEnqueueUnmapMemObject(_device->clQueue(), _mem, data, 0, nullptr, nullptr);
+    TransferEngine::instance().copy(data, host, _size);
+    clEnqueueUnmapMemObject(replica.device->clQueue(), replica.mem, data, 0,
+            nullptr, nullptr);
 }
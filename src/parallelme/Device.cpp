@@ -8,24 +8,76 @@
 
 #include <string>
 #include <parallelme/Device.hpp>
+#include <parallelme/Buffer.hpp>
+#include <parallelme/MemoryPool.hpp>
+#include <parallelme/Profiler.hpp>
+#include "StagingRing.hpp"
 #include "dynloader/dynLoader.h"
 using namespace parallelme;
 
 Device::Device(_cl_device_id *clDevice) : _clDevice(clDevice), _clContext(nullptr),
-        _clQueue(nullptr), _type(findType(clDevice)), _id(genID()) {
+        _clQueue(nullptr), _clTransferQueue(nullptr), _type(findType(clDevice)),
+        _id(genID()), _memoryInUse(0), _currentTask(0) {
     int err;
 
+    cl_bool unified;
+    err = clGetDeviceInfo(_clDevice, CL_DEVICE_HOST_UNIFIED_MEMORY,
+            sizeof(unified), &unified, nullptr);
+    if(err < 0)
+        throw DeviceConstructionError(std::to_string(err));
+    _hostUnifiedMemory = unified == CL_TRUE;
+
+    cl_uint alignBits;
+    err = clGetDeviceInfo(_clDevice, CL_DEVICE_MEM_BASE_ADDR_ALIGN,
+            sizeof(alignBits), &alignBits, nullptr);
+    if(err < 0)
+        throw DeviceConstructionError(std::to_string(err));
+    _memBaseAddrAlign = alignBits / 8;
+
+    cl_device_exec_capabilities capabilities;
+    err = clGetDeviceInfo(_clDevice, CL_DEVICE_EXECUTION_CAPABILITIES,
+            sizeof(capabilities), &capabilities, nullptr);
+    if(err < 0)
+        throw DeviceConstructionError(std::to_string(err));
+    _nativeKernels = (capabilities & CL_EXEC_NATIVE_KERNEL) != 0;
+
+    cl_ulong globalMemSize;
+    err = clGetDeviceInfo(_clDevice, CL_DEVICE_GLOBAL_MEM_SIZE,
+            sizeof(globalMemSize), &globalMemSize, nullptr);
+    if(err < 0)
+        throw DeviceConstructionError(std::to_string(err));
+    _memoryBudget = globalMemSize;
+
     _clContext = clCreateContext(nullptr, 1, &_clDevice, nullptr, nullptr, &err);
     if(err < 0)
         throw DeviceConstructionError(std::to_string(err));
 
-    _clQueue = clCreateCommandQueue(_clContext, _clDevice, 0, &err);
+    cl_command_queue_properties properties = Profiler::instance().enabled()
+        ? CL_QUEUE_PROFILING_ENABLE : 0;
+    _clQueue = clCreateCommandQueue(_clContext, _clDevice, properties, &err);
+    if(err < 0)
+        throw DeviceConstructionError(std::to_string(err));
+
+    _clTransferQueue = clCreateCommandQueue(_clContext, _clDevice, properties,
+            &err);
     if(err < 0)
         throw DeviceConstructionError(std::to_string(err));
 
+    _memoryPool = std::unique_ptr<MemoryPool>(new MemoryPool(_clContext,
+                _memBaseAddrAlign));
+    _stagingRing = std::unique_ptr<StagingRing>(new StagingRing(*this));
 }
 
 Device::~Device() {
+    // The pool and the ring must release their memory objects before the
+    // context.
+    _stagingRing.reset();
+    _memoryPool.reset();
+
+    if(_clTransferQueue) {
+        clReleaseCommandQueue(_clTransferQueue);
+        _clTransferQueue = nullptr;
+    }
     if(_clQueue) {
         clReleaseCommandQueue(_clQueue);
         _clQueue = nullptr;
@@ -40,6 +92,152 @@ void Device::finish() {
     int err = clFinish(_clQueue);
     if(err < 0)
         throw DeviceFinishError(std::to_string(err));
+
+    err = clFinish(_clTransferQueue);
+    if(err < 0)
+        throw DeviceFinishError(std::to_string(err));
+}
+
+void Device::setMemoryBudget(size_t bytes) {
+    std::vector<Victim> victims;
+    {
+        std::lock_guard<std::mutex> lock(_memoryMutex);
+        _memoryBudget = bytes;
+        victims = pickVictims(nullptr, bytes);
+    }
+    evictVictims(victims);
+}
+
+size_t Device::memoryBudget() {
+    std::lock_guard<std::mutex> lock(_memoryMutex);
+    return _memoryBudget;
+}
+
+size_t Device::memoryInUse() {
+    std::lock_guard<std::mutex> lock(_memoryMutex);
+    return _memoryInUse;
+}
+
+void Device::reserveMemory(Buffer *buffer, size_t size) {
+    std::vector<Victim> victims;
+    {
+        std::lock_guard<std::mutex> lock(_memoryMutex);
+        if(_memoryInUse + size > _memoryBudget) {
+            // Cached memory objects are the cheapest to give back.
+            _memoryPool->trim();
+            victims = pickVictims(buffer,
+                    _memoryBudget > size ? _memoryBudget - size : 0);
+        }
+        accountMemory(buffer, size, true);
+    }
+    evictVictims(victims);
+}
+
+void Device::releaseMemory(Buffer *buffer, size_t size) {
+    std::lock_guard<std::mutex> lock(_memoryMutex);
+    auto it = _memoryUse.find(buffer);
+    if(it == _memoryUse.end())
+        return;
+
+    it->second.bytes -= size;
+    _memoryInUse -= size;
+    if(!it->second.bytes) {
+        _lru.erase(it->second.position);
+        _memoryUse.erase(it);
+    }
+}
+
+void Device::reserveMemory(size_t size, Buffer *exclude) {
+    std::vector<Victim> victims;
+    {
+        std::lock_guard<std::mutex> lock(_memoryMutex);
+        if(_memoryInUse + size > _memoryBudget) {
+            _memoryPool->trim();
+            victims = pickVictims(exclude,
+                    _memoryBudget > size ? _memoryBudget - size : 0);
+        }
+        _memoryInUse += size;
+    }
+    evictVictims(victims);
+}
+
+void Device::releaseMemory(size_t size) {
+    std::lock_guard<std::mutex> lock(_memoryMutex);
+    _memoryInUse -= size;
+}
+
+void Device::touchMemory(Buffer *buffer) {
+    std::lock_guard<std::mutex> lock(_memoryMutex);
+    auto it = _memoryUse.find(buffer);
+    if(it != _memoryUse.end())
+        _lru.splice(_lru.end(), _lru, it->second.position);
+}
+
+void Device::reclaimMemory(Buffer *buffer) {
+    std::vector<Victim> victims;
+    {
+        std::lock_guard<std::mutex> lock(_memoryMutex);
+        _memoryPool->trim();
+        victims = pickVictims(buffer, 0);
+    }
+    evictVictims(victims);
+}
+
+void Device::accountMemory(Buffer *buffer, size_t size, bool recent) {
+    auto it = _memoryUse.find(buffer);
+    if(it == _memoryUse.end()) {
+        MemoryUse use;
+        use.position = _lru.insert(recent ? _lru.end() : _lru.begin(),
+                buffer);
+        use.bytes = 0;
+        it = _memoryUse.insert(std::make_pair(buffer, use)).first;
+    }
+    else if(recent) {
+        _lru.splice(_lru.end(), _lru, it->second.position);
+    }
+
+    it->second.bytes += size;
+    _memoryInUse += size;
+}
+
+std::vector<Device::Victim> Device::pickVictims(Buffer *buffer,
+        size_t maxBytes) {
+    std::vector<Victim> victims;
+    for(auto it = _lru.begin(); it != _lru.end() && _memoryInUse > maxBytes;) {
+        auto candidate = *it++;
+        if(candidate == buffer)
+            continue;
+
+        // A buffer locked by another thread is in use. Holding the lock
+        // keeps the buffer alive and unchanged until it is evicted.
+        Victim victim;
+        victim.buffer = candidate;
+        victim.lock = std::unique_lock<std::recursive_mutex>(
+                candidate->_mutex, std::try_to_lock);
+        if(!victim.lock.owns_lock() || !candidate->evictable(*this))
+            continue;
+
+        auto use = _memoryUse.find(candidate);
+        victim.bytes = use->second.bytes;
+        _memoryInUse -= use->second.bytes;
+        _lru.erase(use->second.position);
+        _memoryUse.erase(use);
+        victims.push_back(std::move(victim));
+    }
+
+    return victims;
+}
+
+void Device::evictVictims(std::vector<Victim> &victims) {
+    for(auto &victim : victims) {
+        if(victim.buffer->evict(*this))
+            continue;
+
+        // The copy stays on the device, as the coldest buffer.
+        std::lock_guard<std::mutex> lock(_memoryMutex);
+        accountMemory(victim.buffer, victim.bytes, false);
+    }
+    victims.clear();
 }
 
 Device::Type Device::findType(_cl_device_id *clDevice) {
@@ -0,0 +1,41 @@
+/*                                                _    __ ____
+ *   _ __  ___ _____   ___   __  __   ___ __     / |  / /  __/
+ *  |  _ \/ _ |  _  | / _ | / / / /  / __/ /    /  | / / /__
+ *  |  __/ __ |  ___|/ __ |/ /_/ /__/ __/ /__  / / v  / /__
+ *  |_| /_/ |_|_|\_\/_/ |_/____/___/___/____/ /_/  /_/____/
+ *
+ */
+
+#include <parallelme/Event.hpp>
+#include <string>
+#include "dynloader/dynLoader.h"
+using namespace parallelme;
+
+Event::Event(_cl_event *event) : _clEvent(event) {
+
+}
+
+Event::~Event() {
+    if(_clEvent) {
+        clReleaseEvent(_clEvent);
+        _clEvent = nullptr;
+    }
+}
+
+void Event::wait() {
+    int err = clWaitForEvents(1, &_clEvent);
+    if(err < 0)
+        throw EventError(std::to_string(err));
+}
+
+bool Event::finished() {
+    cl_int status;
+    int err = clGetEventInfo(_clEvent, CL_EVENT_COMMAND_EXECUTION_STATUS,
+            sizeof(status), &status, nullptr);
+    if(err < 0)
+        throw EventError(std::to_string(err));
+    if(status < 0)
+        throw EventError(std::to_string(status));
+
+    return status == CL_COMPLETE;
+}
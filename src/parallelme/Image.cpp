@@ -0,0 +1,213 @@
+/*                                                _    __ ____
+ *   _ __  ___ _____   ___   __  __   ___ __     / |  / /  __/
+ *  |  _ \/ _ |  _  | / _ | / / / /  / __/ /    /  | / / /__
+ *  |  __/ __ |  ___|/ __ |/ /_/ /__/ __/ /__  / / v  / /__
+ *  |_| /_/ |_|_|\_\/_/ |_/____/___/___/____/ /_/  /_/____/
+ *
+ */
+
+#include <parallelme/Image.hpp>
+#include <parallelme/Device.hpp>
+#include <string>
+#include <vector>
+#include <android/bitmap.h>
+#include <jni.h>
+#include "ProfiledCommand.hpp"
+#include "ThreadEnv.hpp"
+#include "dynloader/dynLoader.h"
+using namespace parallelme;
+
+/**
+ * Checks that the bitmap can hold the pixels of the image. Only RGBA8 images
+ * map to a bitmap format, ARGB_8888, so the other formats are rejected.
+ */
+static void checkBitmapInfo(const AndroidBitmapInfo &info, size_t width,
+        size_t height, Image::Format format) {
+    if(info.width != width || info.height != height)
+        throw ImageCopyError("The bitmap doesn't have the size of the image.");
+    if(format != Image::RGBA8)
+        throw ImageCopyError("Only RGBA8 images can be copied to bitmaps.");
+    if(info.format != ANDROID_BITMAP_FORMAT_RGBA_8888)
+        throw ImageCopyError("The bitmap doesn't have the ARGB_8888 format.");
+}
+
+Image::Image(size_t width, size_t height, Format format) : _width(width),
+        _height(height), _format(format), _device(nullptr),
+        _copyPtr(nullptr), _copyBitmap(nullptr), _vm(nullptr) {
+    if(!width || !height)
+        throw ImageConstructionError("The image must not be empty.");
+}
+
+Image::~Image() {
+    for(auto &it : _images)
+        clReleaseMemObject(it.second);
+}
+
+void Image::setAndroidBitmapSource(JNIEnv *env, jobject bitmap) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    releaseCopySources(env);
+
+    _copyBitmap = env->NewGlobalRef(bitmap);
+    if(!_copyBitmap)
+        throw ImageCopyError("Failed to create a new bitmap global ref.");
+    env->GetJavaVM(&_vm);
+}
+
+void Image::setSource(void *host) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    // Other copy sources will be released when calling flushSource().
+    _copyPtr = host;
+}
+
+void Image::copyToAndroidBitmap(JNIEnv *env, jobject bitmap) {
+    AndroidBitmapInfo info;
+    int err = AndroidBitmap_getInfo(env, bitmap, &info);
+    if(err < 0)
+        throw ImageCopyError(std::to_string(err));
+    checkBitmapInfo(info, _width, _height, _format);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if(hasCopySource() && _device)
+        flushSource(_device);
+    if(!_device)
+        throw ImageEmptyError("No device has the contents of the image.");
+
+    void *ptr;
+    err = AndroidBitmap_lockPixels(env, bitmap, &ptr);
+    if(err < 0)
+        throw ImageCopyError(std::to_string(err));
+
+    try {
+        read(_device, ptr, info.stride);
+    }
+    catch(...) {
+        AndroidBitmap_unlockPixels(env, bitmap);
+        throw;
+    }
+
+    AndroidBitmap_unlockPixels(env, bitmap);
+}
+
+void Image::copyTo(void *host) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if(hasCopySource() && _device)
+        flushSource(_device);
+    if(!_device)
+        throw ImageEmptyError("No device has the contents of the image.");
+
+    read(_device, host, _width * pixelSize());
+}
+
+_cl_mem *Image::clMem(std::shared_ptr<Device> device) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto mem = deviceImage(device);
+
+    // The host has the newest data, so outdated copies aren't moved.
+    if(hasCopySource()) {
+        flushSource(device);
+    }
+    else if(_device && _device->id() != device->id()) {
+        // Images can't be copied between contexts, so the pixels go through
+        // the host.
+        std::vector<char> pixels(size());
+        size_t rowPitch = _width * pixelSize();
+        read(_device, pixels.data(), rowPitch);
+        write(device, pixels.data(), rowPitch);
+    }
+
+    _device = device;
+    return mem;
+}
+
+_cl_mem *Image::deviceImage(std::shared_ptr<Device> &device) {
+    auto it = _images.find(device->id());
+    if(it != _images.end())
+        return it->second;
+
+    cl_image_format format;
+    format.image_channel_order = CL_RGBA;
+    format.image_channel_data_type = _format == RGBAFloat ? CL_FLOAT
+        : CL_UNORM_INT8;
+
+    int err;
+    auto mem = clCreateImage2D(device->clContext(), CL_MEM_READ_WRITE,
+            &format, _width, _height, 0, nullptr, &err);
+    if(err < 0)
+        throw ImageConstructionError(std::to_string(err));
+
+    _images.insert(std::make_pair(device->id(), mem));
+    return mem;
+}
+
+void Image::flushSource(std::shared_ptr<Device> &device) {
+    // The bitmap is accessed through the JNIEnv of the calling thread.
+    ThreadEnv threadEnv(_copyBitmap ? _vm : nullptr);
+    auto env = threadEnv.get();
+    if(_copyBitmap && !env)
+        throw ImageCopyError("Failed to get the JNIEnv of the thread.");
+
+    // _copyPtr has preference because setSource() doesn't call
+    // releaseCopySources(), so _copyBitmap may still have a reference to clear.
+    if(_copyPtr) {
+        write(device, _copyPtr, _width * pixelSize());
+    }
+    else { // _copyBitmap
+        AndroidBitmapInfo info;
+        int err = AndroidBitmap_getInfo(env, _copyBitmap, &info);
+        if(err < 0)
+            throw ImageCopyError("Failed to get android bitmap's info.");
+        checkBitmapInfo(info, _width, _height, _format);
+
+        void *ptr;
+        err = AndroidBitmap_lockPixels(env, _copyBitmap, &ptr);
+        if(err < 0)
+            throw ImageCopyError("Failed to lock android bitmap's pixels.");
+
+        try {
+            write(device, ptr, info.stride);
+        }
+        catch(...) {
+            AndroidBitmap_unlockPixels(env, _copyBitmap);
+            throw;
+        }
+
+        AndroidBitmap_unlockPixels(env, _copyBitmap);
+    }
+
+    releaseCopySources(env);
+    _device = device;
+}
+
+void Image::write(std::shared_ptr<Device> &device, const void *host,
+        size_t rowPitch) {
+    size_t origin[] = { 0, 0, 0 };
+    size_t region[] = { _width, _height, 1 };
+    ProfiledCommand write(device->id(), "write");
+    int err = clEnqueueWriteImage(device->clQueue(), deviceImage(device),
+            CL_TRUE, origin, region, rowPitch, 0, host, 0, nullptr,
+            write.event());
+    if(err < 0)
+        throw ImageCopyError(std::to_string(err));
+}
+
+void Image::read(std::shared_ptr<Device> &device, void *host,
+        size_t rowPitch) {
+    size_t origin[] = { 0, 0, 0 };
+    size_t region[] = { _width, _height, 1 };
+    ProfiledCommand read(device->id(), "read");
+    int err = clEnqueueReadImage(device->clQueue(), deviceImage(device),
+            CL_TRUE, origin, region, rowPitch, 0, host, 0, nullptr,
+            read.event());
+    if(err < 0)
+        throw ImageCopyError(std::to_string(err));
+}
+
+void Image::releaseCopySources(JNIEnv *env) {
+    if(_copyPtr) {
+        _copyPtr = nullptr;
+    }
+    if(_copyBitmap) {
+        env->DeleteGlobalRef(_copyBitmap);
+        _copyBitmap = nullptr;
+    }
+}
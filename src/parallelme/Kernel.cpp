@@ -9,54 +9,391 @@
 #include <parallelme/Kernel.hpp>
 #include <parallelme/Buffer.hpp>
 #include <parallelme/Device.hpp>
+#include <parallelme/Image.hpp>
+#include <parallelme/KernelArgs.hpp>
 #include <parallelme/Program.hpp>
+#include <parallelme/WorkGroupTuner.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
 #include <string>
+#include "ProfiledCommand.hpp"
 #include "dynloader/dynLoader.h"
+#include "util/error.h"
 using namespace parallelme;
 
+const size_t Kernel::SplitGranularity;
+const size_t Kernel::PaddingHeight;
+
+/**
+ * Execution of a native kernel, owned by the function that runs it.
+ */
+struct NativeCall {
+    std::function<void (void **)> function;
+    std::vector<std::string> values;    /// Values of the primitives.
+};
+
+/// Runs a native kernel. The block of arguments starts with its call.
+static void CL_CALLBACK runNativeCall(void *block) {
+    auto args = (void **) block;
+    auto call = (NativeCall *) args[0];
+    try {
+        call->function(args + 1);
+    }
+    catch(std::exception &e) {
+        printError("Native kernel failed: %s", e.what());
+    }
+    delete call;
+}
+
 Kernel::Kernel(const std::string &name, std::shared_ptr<Device> device,
-        Program &program) : _device(device) {
-    int err;
+        std::shared_ptr<Program> program) : _name(name), _device(device),
+        _program(program), _padded(false), _lastArgUnset(false),
+        _split(false), _partBegin(0.0), _partEnd(1.0) {
+    _cached = program->takeKernel(device->id(), name);
+    if(_cached.kernel)
+        return;
 
-    _clKernel = clCreateKernel(program.clProgram(device->id()), name.c_str(), &err);
+    // Tasks that run at the same time need their own kernels for the args.
+    int err;
+    _cached.kernel = clCreateKernel(program->clProgram(device->id()),
+            name.c_str(), &err);
     if(err < 0)
         throw KernelConstructionError(std::to_string(err));
+
+    cl_uint numArgs;
+    err = clGetKernelInfo(_cached.kernel, CL_KERNEL_NUM_ARGS, sizeof(numArgs),
+            &numArgs, nullptr);
+    if(err < 0) {
+        clReleaseKernel(_cached.kernel);
+        throw KernelConstructionError(std::to_string(err));
+    }
+    _cached.args.resize(numArgs);
+}
+
+Kernel::Kernel(const std::string &name, std::shared_ptr<Device> device,
+        std::function<void (void **)> function) : _name(name),
+        _device(device), _padded(false), _lastArgUnset(false),
+        _split(false), _partBegin(0.0), _partEnd(1.0), _native(function) {
+    if(!device->nativeKernels())
+        throw KernelConstructionError("The device doesn't execute native "
+                "kernels.");
+    _cached.kernel = nullptr;
+    _cached.preferredMultiple = 0;
 }
 
 Kernel::~Kernel() {
-    if(_clKernel) {
-        clReleaseKernel(_clKernel);
-        _clKernel = nullptr;
+    if(_cached.kernel) {
+        _program->cacheKernel(_device->id(), _name, std::move(_cached));
+        _cached.kernel = nullptr;
     }
 }
 
 void Kernel::run() {
+    if(_native) {
+        runNative();
+        return;
+    }
+
     size_t offset[] = { 0, 0, 0 };
     size_t workSize[] = { _xDim, _yDim, _zDim };
-    int err = clEnqueueNDRangeKernel(_device->clQueue(), _clKernel, 3, offset,
-            workSize, nullptr, 0, nullptr, nullptr);
+    size_t logical[] = { _xDim, _yDim, _zDim };
+    if(_lastArgUnset && !_padded)
+        throw KernelArgError("The last argument of " + _name
+                + " wasn't set.");
+    if(_padded)
+        padWorkSize(workSize);
+    if(_split) {
+        // Only the last dimension with more than one item is split.
+        unsigned dimension = 2;
+        while(dimension > 0 && workSize[dimension] <= 1)
+            --dimension;
+
+        // The buffers only hold the items before padding.
+        auto range = partRange(workSize[dimension]);
+        size_t size = logical[dimension];
+        setPartArgs(std::min(range.first, size), std::min(range.second, size),
+                size);
+        if(range.first == range.second)
+            return;
+        offset[dimension] = range.first;
+        workSize[dimension] = range.second - range.first;
+    }
+
+    auto queue = _device->clQueue();
+    auto &tuner = WorkGroupTuner::instance();
+    auto choice = tuner.choose(*_device, _cached.kernel, _program->sourceHash(),
+            _name, workSize);
+    auto local = choice.local[0] ? choice.local.data() : nullptr;
+
+    // Trials are timed alone on the device.
+    std::chrono::steady_clock::time_point start;
+    if(choice.trial >= 0) {
+        clFinish(queue);
+        start = std::chrono::steady_clock::now();
+    }
+
+    ProfiledCommand execution(_device->id(), _name.c_str(),
+            Profiler::KernelCommand);
+    int err = clEnqueueNDRangeKernel(queue, _cached.kernel, 3, offset, workSize,
+            local, 0, nullptr, execution.event());
+    if(choice.trial >= 0) {
+        int finishErr = err < 0 ? err : clFinish(queue);
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        tuner.finishTrial(choice, finishErr < 0 ? -1.0 : elapsed.count());
+
+        // The kernel was queued, so running it again could apply it twice.
+        if(err >= 0 && finishErr < 0)
+            throw KernelExecutionError(std::to_string(finishErr));
+    }
+
+    // Shapes the device can't run with the kernel's resources fall back to
+    // the driver's choice.
+    if(err < 0 && local)
+        err = clEnqueueNDRangeKernel(queue, _cached.kernel, 3, offset, workSize,
+                nullptr, 0, nullptr, execution.event());
     if(err < 0)
         throw KernelExecutionError(std::to_string(err));
+    notifyWrites();
+}
+
+void Kernel::runNative() {
+    // The driver copies the block and replaces the memory objects in the
+    // copy with their host addresses.
+    std::unique_ptr<NativeCall> call(new NativeCall());
+    call->function = _native;
+    for(auto &arg : _nativeArgs)
+        call->values.push_back(arg.mem ? std::string() : arg.value);
+
+    std::vector<void *> block(_nativeArgs.size() + 1, nullptr);
+    std::vector<_cl_mem *> mems;
+    std::vector<const void *> locations;
+    block[0] = call.get();
+    for(size_t i = 0; i < _nativeArgs.size(); ++i) {
+        auto &arg = _nativeArgs[i];
+        if(arg.mem) {
+            block[i + 1] = arg.mem;
+            mems.push_back(arg.mem);
+            locations.push_back(&block[i + 1]);
+        }
+        else if(!arg.value.empty()) {
+            block[i + 1] = &call->values[i][0];
+        }
+    }
+
+    ProfiledCommand execution(_device->id(), _name.c_str(),
+            Profiler::KernelCommand);
+    int err = clEnqueueNativeKernel(_device->clQueue(), runNativeCall,
+            block.data(), block.size() * sizeof(void *), mems.size(),
+            mems.empty() ? nullptr : mems.data(),
+            locations.empty() ? nullptr : locations.data(), 0, nullptr,
+            execution.event());
+    if(err < 0)
+        throw KernelExecutionError(std::to_string(err));
+    call.release();
+    notifyWrites();
+}
+
+void Kernel::setWrites(unsigned id, std::shared_ptr<Buffer> &buffer,
+        Buffer::Access access, size_t begin, size_t end) {
+    if(access == Buffer::ReadOnly) {
+        _writes.erase(id);
+        return;
+    }
+
+    WrittenRange range = { buffer, begin, end };
+    _writes[id] = range;
+}
+
+void Kernel::notifyWrites() {
+    for(auto &it : _writes)
+        it.second.buffer->kernelWrote(it.second.begin, it.second.end);
 }
 
-Kernel *Kernel::setArg(unsigned id, std::shared_ptr<Buffer> buffer) {
+void Kernel::padWorkSize(size_t workSize[3]) {
+    auto &multiple = _cached.preferredMultiple;
+    if(!multiple) {
+        int err = clGetKernelWorkGroupInfo(_cached.kernel, _device->clDevice(),
+                CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(multiple),
+                &multiple, nullptr);
+        if(err < 0 || !multiple)
+            multiple = 1;
+    }
+
+    if(_cached.args.empty())
+        throw KernelArgError("The kernel " + _name
+                + " doesn't declare PM_WORK_SIZE.");
+    cl_uint size[] = {
+        (cl_uint) workSize[0], (cl_uint) workSize[1], (cl_uint) workSize[2], 0
+    };
+    int err = bindArg(_cached.args.size() - 1, sizeof(size), size, false);
+    if(err < 0)
+        throw KernelArgError("The last argument of " + _name
+                + " isn't PM_WORK_SIZE: " + std::to_string(err));
+
+    workSize[0] = (workSize[0] + multiple - 1) / multiple * multiple;
+    if(workSize[1] > 1)
+        workSize[1] = (workSize[1] + PaddingHeight - 1) / PaddingHeight
+            * PaddingHeight;
+}
+
+void Kernel::setPart(double begin, double end) {
+    _split = true;
+    _partBegin = begin;
+    _partEnd = end;
+}
+
+std::pair<size_t, size_t> Kernel::partRange(size_t size) {
+    auto item = [size] (double fraction) {
+        if(fraction >= 1.0)
+            return size;
+        size_t rounded = (size_t) (fraction * size + 0.5);
+        rounded = (rounded + SplitGranularity / 2) / SplitGranularity
+            * SplitGranularity;
+        return std::min(rounded, size);
+    };
+
+    return std::make_pair(item(_partBegin), item(_partEnd));
+}
+
+void Kernel::setPartArgs(size_t begin, size_t end, size_t size) {
+    for(auto &arg : _bufferArgs) {
+        // Reads may reach the neighbours of the part, but writes don't. The
+        // products are 64-bit, as they overflow a 32-bit size_t.
+        _cl_mem *mem;
+        uint64_t bytes = arg.buffer->size();
+        size_t first = (size_t) (bytes * begin / size);
+        size_t last = (size_t) (bytes * end / size);
+        if(arg.access == Buffer::ReadOnly)
+            mem = arg.buffer->clMem(_device, arg.access);
+        else
+            mem = arg.buffer->clMem(_device, arg.access, first, last);
+        setWrites(arg.id, arg.buffer, arg.access, first, last);
+
+        int err = bindArg(arg.id, sizeof(mem), &mem, true);
+        if(err < 0)
+            throw KernelArgError(std::string("Buffer error: ")
+                    + std::to_string(err));
+    }
+}
+
+Kernel *Kernel::setArg(unsigned id, std::shared_ptr<Buffer> buffer,
+        Buffer::Access access) {
+    if(id + 1 == _cached.args.size())
+        _lastArgUnset = false;
+
+    // The bytes of the part depend on the work size, which may be set later.
+    if(_split) {
+        BufferArg arg = { id, buffer, access };
+        auto it = std::find_if(_bufferArgs.begin(), _bufferArgs.end(),
+                [id] (BufferArg &other) { return other.id == id; });
+        if(it != _bufferArgs.end())
+            *it = arg;
+        else
+            _bufferArgs.push_back(arg);
+        _writes.erase(id);
+        return this;
+    }
+
     int err;
-    auto mem = buffer->clMem(_device);
+    auto mem = buffer->clMem(_device, access);
 
-    err = clSetKernelArg(_clKernel, id, sizeof(mem), &mem);
+    err = bindArg(id, sizeof(mem), &mem, true);
     if(err < 0)
         throw KernelArgError(std::string("Buffer error: ") + std::to_string(err));
+    setWrites(id, buffer, access, 0, buffer->size());
 
     return this;
 }
 
-Kernel *Kernel::setPrimitiveArg(unsigned id, size_t size, void *host) {
+Kernel *Kernel::setArg(unsigned id, std::shared_ptr<Image> image) {
+    if(_native)
+        throw KernelArgError("Native kernels only take buffers.");
+
     int err;
+    auto mem = image->clMem(_device);
 
-    err = clSetKernelArg(_clKernel, id, size, host);
+    err = bindArg(id, sizeof(mem), &mem, true);
+    if(err < 0)
+        throw KernelArgError(std::string("Image error: ") + std::to_string(err));
+    _writes.erase(id);
+    if(id + 1 == _cached.args.size())
+        _lastArgUnset = false;
+
+    return this;
+}
+
+Kernel *Kernel::setArgs(std::shared_ptr<const KernelArgs> args) {
+    // The pack can't change, so it is only checked once.
+    // Padded work sizes set the last argument themselves, which run() checks
+    // as the work size may be set after the arguments.
+    size_t count = args->_args.size();
+    size_t numArgs = _cached.args.size();
+    bool hidden = count + 1 == numArgs
+        && (args->_args.empty() || args->_args.back().id + 1 < numArgs);
+    auto &validated = _cached.validated;
+    if(!_native && (validated.expired() || validated.owner_before(args)
+            || args.owner_before(validated))) {
+        if(count != numArgs && !hidden)
+            throw KernelArgError("The pack doesn't set all the arguments of "
+                    + _name + ".");
+        for(auto &arg : args->_args) {
+            if(arg.id >= numArgs)
+                throw KernelArgError("The kernel " + _name
+                        + " has no argument " + std::to_string(arg.id) + ".");
+        }
+        validated = args;
+    }
+
+    for(auto &arg : args->_args) {
+        if(arg.buffer)
+            setArg(arg.id, arg.buffer, arg.access);
+        else
+            setPrimitiveArg(arg.id, arg.value.size(), arg.value.data());
+    }
+    _lastArgUnset = !_native && hidden;
+
+    return this;
+}
+
+Kernel *Kernel::setPrimitiveArg(unsigned id, size_t size, const void *host) {
+    int err;
+
+    err = bindArg(id, size, host, false);
     if(err < 0)
         throw KernelArgError(std::string("Primitive error: ") + std::to_string(err));
+    _writes.erase(id);
+    if(id + 1 == _cached.args.size())
+        _lastArgUnset = false;
 
     return this;
 }
 
+
+int Kernel::bindArg(unsigned id, size_t size, const void *value, bool isMem) {
+    // Native kernels get their arguments when enqueued.
+    if(_native) {
+        if(id >= _nativeArgs.size())
+            _nativeArgs.resize(id + 1, NativeArg());
+        auto &arg = _nativeArgs[id];
+        arg.mem = isMem ? *(_cl_mem * const *) value : nullptr;
+        arg.value = isMem ? std::string() : std::string((const char *) value,
+                size);
+        return 0;
+    }
+
+    // A freed memory object's handle may be reused by a new one, so only
+    // primitives are compared.
+    std::string bytes = isMem ? std::string()
+        : std::string((const char *) value, size);
+    if(!isMem && id < _cached.args.size() && _cached.args[id] == bytes)
+        return 0;
+
+    int err = clSetKernelArg(_cached.kernel, id, size, value);
+    if(err < 0 || id >= _cached.args.size())
+        return err;
+
+    _cached.args[id] = bytes;
+    return 0;
+}
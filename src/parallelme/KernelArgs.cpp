@@ -0,0 +1,39 @@
+/*                                                _    __ ____
+ *   _ __  ___ _____   ___   __  __   ___ __     / |  / /  __/
+ *  |  _ \/ _ |  _  | / _ | / / / /  / __/ /    /  | / / /__
+ *  |  __/ __ |  ___|/ __ |/ /_/ /__/ __/ /__  / / v  / /__
+ *  |_| /_/ |_|_|\_\/_/ |_/____/___/___/____/ /_/  /_/____/
+ *
+ */
+
+#include <parallelme/KernelArgs.hpp>
+using namespace parallelme;
+
+KernelArgs::Builder &KernelArgs::Builder::setArg(unsigned id,
+        std::shared_ptr<Buffer> buffer, Buffer::Access access) {
+    auto &arg = _args[id];
+    arg.id = id;
+    arg.buffer = buffer;
+    arg.access = access;
+    arg.value.clear();
+    return *this;
+}
+
+std::shared_ptr<const KernelArgs> KernelArgs::Builder::build() {
+    // I don't use std::make_shared here because the constructor is private.
+    auto args = std::shared_ptr<KernelArgs>(new KernelArgs());
+    for(auto &it : _args)
+        args->_args.push_back(it.second);
+
+    return args;
+}
+
+KernelArgs::Builder &KernelArgs::Builder::setPrimitiveArg(unsigned id,
+        size_t size, const void *host) {
+    auto &arg = _args[id];
+    arg.id = id;
+    arg.buffer = nullptr;
+    arg.access = Buffer::ReadWrite;
+    arg.value.assign((const char *) host, size);
+    return *this;
+}
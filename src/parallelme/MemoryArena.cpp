@@ -0,0 +1,183 @@
+/*                                                _    __ ____
+ *   _ __  ___ _____   ___   __  __   ___ __     / |  / /  __/
+ *  |  _ \/ _ |  _  | / _ | / / / /  / __/ /    /  | / / /__
+ *  |  __/ __ |  ___|/ __ |/ /_/ /__/ __/ /__  / / v  / /__
+ *  |_| /_/ |_|_|\_\/_/ |_/____/___/___/____/ /_/  /_/____/
+ *
+ */
+
+#include <parallelme/MemoryArena.hpp>
+#include <algorithm>
+#include <string>
+#include "dynloader/dynLoader.h"
+using namespace parallelme;
+
+const size_t MemoryArena::BlockSize;
+const size_t MemoryArena::MaxAllocationSize;
+
+MemoryArena::MemoryArena(_cl_context *context, size_t alignment)
+        : _context(context), _minSize(256), _numOrders(1),
+        _requestedBytes(0) {
+    // Pieces must start at offsets aligned as the device requires.
+    while(_minSize < alignment)
+        _minSize <<= 1;
+    while(orderSize(_numOrders - 1) < BlockSize)
+        ++_numOrders;
+}
+
+MemoryArena::~MemoryArena() {
+    for(auto &it : _allocations)
+        clReleaseMemObject(it.first);
+    for(auto &block : _blocks)
+        clReleaseMemObject(block.mem);
+}
+
+_cl_mem *MemoryArena::acquire(size_t size, uint64_t flags) {
+    if(!size || size > MaxAllocationSize || size > orderSize(_numOrders - 1))
+        throw MemoryArenaError("The size isn't served by the arena.");
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto allocation = allocate(order(size));
+    allocation.size = size;
+
+    int err;
+    cl_buffer_region region = { allocation.offset, size };
+    auto mem = clCreateSubBuffer(allocation.block->mem, flags,
+            CL_BUFFER_CREATE_TYPE_REGION, &region, &err);
+    if(err < 0) {
+        deallocate(allocation);
+        throw MemoryArenaError(std::to_string(err));
+    }
+
+    _allocations.insert(std::make_pair(mem, allocation));
+    _requestedBytes += size;
+    return mem;
+}
+
+bool MemoryArena::release(_cl_mem *mem) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _allocations.find(mem);
+    if(it == _allocations.end())
+        return false;
+
+    clReleaseMemObject(mem);
+    _requestedBytes -= it->second.size;
+    deallocate(it->second);
+    _allocations.erase(it);
+    return true;
+}
+
+void MemoryArena::trim() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for(auto it = _blocks.begin(); it != _blocks.end();) {
+        if(empty(*it)) {
+            clReleaseMemObject(it->mem);
+            it = _blocks.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+MemoryArena::Statistics MemoryArena::statistics() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    Statistics statistics;
+    statistics.reservedBytes = _blocks.size() * orderSize(_numOrders - 1);
+    statistics.allocatedBytes = 0;
+    statistics.requestedBytes = _requestedBytes;
+    statistics.largestFreeBytes = 0;
+    statistics.allocations = _allocations.size();
+
+    for(auto &block : _blocks) {
+        statistics.allocatedBytes += block.allocatedBytes;
+        for(unsigned i = _numOrders; i > 0; --i) {
+            if(!block.free[i - 1].empty()) {
+                statistics.largestFreeBytes = std::max(
+                        statistics.largestFreeBytes, orderSize(i - 1));
+                break;
+            }
+        }
+    }
+
+    return statistics;
+}
+
+unsigned MemoryArena::order(size_t size) {
+    unsigned order = 0;
+    while(orderSize(order) < size)
+        ++order;
+    return order;
+}
+
+MemoryArena::Allocation MemoryArena::allocate(unsigned order) {
+    // Use the smallest free piece that fits, so big pieces stay whole.
+    auto block = _blocks.end();
+    unsigned found = _numOrders;
+    for(auto it = _blocks.begin(); it != _blocks.end(); ++it) {
+        for(unsigned i = order; i < found; ++i) {
+            if(!it->free[i].empty()) {
+                block = it;
+                found = i;
+                break;
+            }
+        }
+    }
+
+    if(block == _blocks.end()) {
+        int err;
+        Block newBlock;
+        newBlock.mem = clCreateBuffer(_context, CL_MEM_READ_WRITE,
+                orderSize(_numOrders - 1), nullptr, &err);
+        if(err < 0)
+            throw MemoryArenaError(std::to_string(err));
+        newBlock.free.resize(_numOrders);
+        newBlock.free[_numOrders - 1].insert(0);
+        newBlock.allocatedBytes = 0;
+
+        block = _blocks.insert(_blocks.end(), newBlock);
+        found = _numOrders - 1;
+    }
+
+    size_t offset = *block->free[found].begin();
+    block->free[found].erase(block->free[found].begin());
+
+    // Split the piece, keeping the first half, until it has the right order.
+    while(found > order) {
+        --found;
+        block->free[found].insert(offset + orderSize(found));
+    }
+
+    block->allocatedBytes += orderSize(order);
+
+    Allocation allocation;
+    allocation.block = block;
+    allocation.offset = offset;
+    allocation.order = order;
+    allocation.size = 0;
+    return allocation;
+}
+
+void MemoryArena::deallocate(const Allocation &allocation) {
+    auto &block = *allocation.block;
+    size_t offset = allocation.offset;
+    unsigned order = allocation.order;
+    block.allocatedBytes -= orderSize(order);
+
+    while(order + 1 < _numOrders) {
+        auto buddy = block.free[order].find(offset ^ orderSize(order));
+        if(buddy == block.free[order].end())
+            break;
+
+        block.free[order].erase(buddy);
+        offset &= ~orderSize(order);
+        ++order;
+    }
+    block.free[order].insert(offset);
+
+    // Keep one empty block around for the next small buffers.
+    if(empty(block) && _blocks.size() > 1) {
+        clReleaseMemObject(block.mem);
+        _blocks.erase(allocation.block);
+    }
+}
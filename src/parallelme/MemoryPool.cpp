@@ -0,0 +1,139 @@
+/*                                                _    __ ____
+ *   _ __  ___ _____   ___   __  __   ___ __     / |  / /  __/
+ *  |  _ \/ _ |  _  | / _ | / / / /  / __/ /    /  | / / /__
+ *  |  __/ __ |  ___|/ __ |/ /_/ /__/ __/ /__  / / v  / /__
+ *  |_| /_/ |_|_|\_\/_/ |_/____/___/___/____/ /_/  /_/____/
+ *
+ */
+
+#include <parallelme/MemoryPool.hpp>
+#include <string>
+#include "dynloader/dynLoader.h"
+using namespace parallelme;
+
+MemoryPool::MemoryPool(_cl_context *context, size_t alignment,
+        size_t maxRetainedBytes) : _context(context),
+        _arena(context, alignment), _maxRetainedBytes(maxRetainedBytes),
+        _retainedBytes(0), _hits(0), _misses(0) {
+
+}
+
+MemoryPool::~MemoryPool() {
+    shrink(0);
+}
+
+size_t MemoryPool::sizeClass(size_t size) {
+    if(size <= MinClassSize)
+        return MinClassSize;
+
+    // Round up to a multiple of a quarter of the largest power of two below
+    // size, which gives four classes between each power of two and the next.
+    size_t power = MinClassSize;
+    while(power < (size - 1) / 2 + 1)
+        power <<= 1;
+
+    size_t step = power / 4;
+    return (size + step - 1) / step * step;
+}
+
+_cl_mem *MemoryPool::acquire(size_t size, uint64_t flags, bool subAllocate) {
+    auto hostFlags = CL_MEM_USE_HOST_PTR | CL_MEM_ALLOC_HOST_PTR
+        | CL_MEM_COPY_HOST_PTR;
+    if(subAllocate && size <= MemoryArena::MaxAllocationSize
+            && !(flags & hostFlags)) {
+        try {
+            return _arena.acquire(size, flags);
+        }
+        catch(MemoryArenaError &) {
+            // Fall back to a memory object of its own.
+        }
+    }
+
+    size_t classSize = sizeClass(size);
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    auto it = _free.find(Key(classSize, flags));
+    if(it != _free.end() && !it->second.empty()) {
+        auto mem = it->second.back();
+        it->second.pop_back();
+        _retainedBytes -= classSize;
+        ++_hits;
+        return mem;
+    }
+
+    ++_misses;
+    int err;
+    auto mem = clCreateBuffer(_context, flags, classSize, nullptr, &err);
+    if(err < 0 && _retainedBytes) {
+        // The driver may be out of memory because of what we are holding.
+        shrink(0);
+        mem = clCreateBuffer(_context, flags, classSize, nullptr, &err);
+    }
+    if(err < 0)
+        throw MemoryPoolError(std::to_string(err));
+
+    return mem;
+}
+
+void MemoryPool::release(_cl_mem *mem, size_t size, uint64_t flags) {
+    if(_arena.release(mem))
+        return;
+
+    size_t classSize = sizeClass(size);
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    if(_retainedBytes + classSize > _maxRetainedBytes) {
+        clReleaseMemObject(mem);
+        return;
+    }
+
+    _free[Key(classSize, flags)].push_back(mem);
+    _retainedBytes += classSize;
+}
+
+void MemoryPool::trim() {
+    _arena.trim();
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    shrink(0);
+}
+
+void MemoryPool::setMaxRetainedBytes(size_t maxRetainedBytes) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _maxRetainedBytes = maxRetainedBytes;
+    shrink(maxRetainedBytes);
+}
+
+size_t MemoryPool::maxRetainedBytes() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _maxRetainedBytes;
+}
+
+size_t MemoryPool::retainedBytes() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _retainedBytes;
+}
+
+size_t MemoryPool::hits() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _hits;
+}
+
+size_t MemoryPool::misses() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _misses;
+}
+
+void MemoryPool::shrink(size_t maxBytes) {
+    // Release the biggest classes first, they free the most memory. The keys
+    // sort the lists by size, whatever their flags.
+    for(auto it = _free.rbegin(); it != _free.rend()
+            && _retainedBytes > maxBytes; ++it) {
+        auto &list = it->second;
+        while(!list.empty() && _retainedBytes > maxBytes) {
+            clReleaseMemObject(list.back());
+            list.pop_back();
+            _retainedBytes -= it->first.first;
+        }
+    }
+}
@@ -0,0 +1,55 @@
+/*                                                _    __ ____
+ *   _ __  ___ _____   ___   __  __   ___ __     / |  / /  __/
+ *  |  _ \/ _ |  _  | / _ | / / / /  / __/ /    /  | / / /__
+ *  |  __/ __ |  ___|/ __ |/ /_/ /__/ __/ /__  / / v  / /__
+ *  |_| /_/ |_|_|\_\/_/ |_/____/___/___/____/ /_/  /_/____/
+ *
+ */
+
+#ifndef PARALLELME_PROFILEDCOMMAND_HPP
+#define PARALLELME_PROFILEDCOMMAND_HPP
+
+#include <parallelme/Profiler.hpp>
+#include <string>
+
+namespace parallelme {
+
+/**
+ * Event of a command that is given to the profiler when this object goes
+ * out of scope. Pass event() as the event output of the command.
+ *
+ * @author Renato Utsch
+ */
+class ProfiledCommand {
+public:
+    ProfiledCommand(unsigned deviceID, const char *name,
+            Profiler::Command command = Profiler::TransferCommand)
+            : _deviceID(deviceID), _name(name), _command(command),
+            _event(nullptr) { }
+
+    ProfiledCommand(const ProfiledCommand &) = delete;
+    ProfiledCommand &operator=(const ProfiledCommand &) = delete;
+
+    ~ProfiledCommand() {
+        if(_event)
+            Profiler::instance().record(_deviceID, _name, _command, _event);
+    }
+
+    /**
+     * Returns where the command writes its event, or nullptr if profiling
+     * is disabled.
+     */
+    inline _cl_event **event() {
+        return Profiler::instance().track(&_event);
+    }
+
+private:
+    unsigned _deviceID;
+    const char *_name;
+    Profiler::Command _command;
+    _cl_event *_event;
+};
+
+}
+
+#endif // !PARALLELME_PROFILEDCOMMAND_HPP
@@ -0,0 +1,123 @@
+/*                                                _    __ ____
+ *   _ __  ___ _____   ___   __  __   ___ __     / |  / /  __/
+ *  |  _ \/ _ |  _  | / _ | / / / /  / __/ /    /  | / / /__
+ *  |  __/ __ |  ___|/ __ |/ /_/ /__/ __/ /__  / / v  / /__
+ *  |_| /_/ |_|_|\_\/_/ |_/____/___/___/____/ /_/  /_/____/
+ *
+ */
+
+#include <parallelme/Profiler.hpp>
+#include <algorithm>
+#include "dynloader/dynLoader.h"
+using namespace parallelme;
+
+const size_t Profiler::MaxPending;
+
+Profiler &Profiler::instance() {
+    static Profiler profiler;
+    return profiler;
+}
+
+Profiler::Profiler() : _enabled(false) {
+
+}
+
+Profiler::~Profiler() {
+    for(auto &pending : _pending)
+        clReleaseEvent(pending.event);
+}
+
+void Profiler::record(unsigned deviceID, const std::string &name,
+        Command command, _cl_event *event) {
+    if(!event)
+        return;
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    Pending pending = { deviceID, name, command, event };
+    _pending.push_back(pending);
+    if(_pending.size() >= MaxPending)
+        collect(false);
+}
+
+std::vector<Profiler::Statistics> Profiler::statistics() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    collect(true);
+
+    std::vector<Statistics> statistics;
+    for(auto &it : _statistics)
+        statistics.push_back(it.second);
+    return statistics;
+}
+
+void Profiler::reset() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for(auto &pending : _pending)
+        clReleaseEvent(pending.event);
+    _pending.clear();
+    _statistics.clear();
+}
+
+void Profiler::collect(bool wait) {
+    auto finished = [wait] (Pending &pending) {
+        if(wait) {
+            clWaitForEvents(1, &pending.event);
+            return true;
+        }
+
+        cl_int status;
+        int err = clGetEventInfo(pending.event,
+                CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status,
+                nullptr);
+        return err < 0 || status == CL_COMPLETE || status < 0;
+    };
+
+    auto it = std::remove_if(_pending.begin(), _pending.end(),
+            [&] (Pending &pending) {
+        if(!finished(pending))
+            return false;
+
+        // Queues created without profiling and failed commands have no times.
+        cl_ulong times[4];
+        cl_profiling_info params[] = {
+            CL_PROFILING_COMMAND_QUEUED, CL_PROFILING_COMMAND_SUBMIT,
+            CL_PROFILING_COMMAND_START, CL_PROFILING_COMMAND_END
+        };
+        bool valid = true;
+        for(unsigned i = 0; i < 4 && valid; ++i) {
+            valid = clGetEventProfilingInfo(pending.event, params[i],
+                    sizeof(times[i]), &times[i], nullptr) >= 0;
+        }
+        clReleaseEvent(pending.event);
+        if(!valid)
+            return true;
+
+        Key key(pending.command, pending.name, pending.deviceID);
+        auto entry = _statistics.find(key);
+        if(entry == _statistics.end()) {
+            Statistics statistics;
+            statistics.name = pending.name;
+            statistics.deviceID = pending.deviceID;
+            statistics.command = pending.command;
+            statistics.count = 0;
+            statistics.queueTime = 0;
+            statistics.submitTime = 0;
+            statistics.executionTime = 0;
+            statistics.minExecutionTime = UINT64_MAX;
+            statistics.maxExecutionTime = 0;
+            entry = _statistics.insert(std::make_pair(key, statistics)).first;
+        }
+
+        auto &statistics = entry->second;
+        uint64_t execution = times[3] - times[2];
+        ++statistics.count;
+        statistics.queueTime += times[1] - times[0];
+        statistics.submitTime += times[2] - times[1];
+        statistics.executionTime += execution;
+        statistics.minExecutionTime = std::min(statistics.minExecutionTime,
+                execution);
+        statistics.maxExecutionTime = std::max(statistics.maxExecutionTime,
+                execution);
+        return true;
+    });
+    _pending.erase(it, _pending.end());
+}
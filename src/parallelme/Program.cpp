@@ -14,14 +14,35 @@
 #include "util/error.h"
 using namespace parallelme;
 
+/// FNV-1a hash of a string, which doesn't change between executions.
+static uint64_t hashString(const char *str, uint64_t hash) {
+    for(; *str; ++str)
+        hash = (hash ^ (unsigned char) *str) * 1099511628211ull;
+    return hash;
+}
+
+/// Helpers for padded work sizes. Build logs keep the lines of the source.
+static const char *kernelPrelude =
+    "#define PM_WORK_SIZE const uint4 pm_workSize\n"
+    "#define PM_IN_RANGE() (get_global_id(0) < pm_workSize.x \\\n"
+    "        && get_global_id(1) < pm_workSize.y \\\n"
+    "        && get_global_id(2) < pm_workSize.z)\n"
+    "#define PM_GLOBAL_SIZE(dim) ((dim) == 0 ? pm_workSize.x \\\n"
+    "        : (dim) == 1 ? pm_workSize.y : pm_workSize.z)\n"
+    "#line 1\n";
 
 Program::Program(std::shared_ptr<Runtime> runtime, const char *source,
-        const char *compilerFlags) {
+        const char *compilerFlags) : _sourceHash(hashString(source,
+            14695981039346656037ull)) {
     int err;
 
+    if(compilerFlags)
+        _sourceHash = hashString(compilerFlags, _sourceHash);
+
     for(auto &device : runtime->devices()) {
-        auto program = clCreateProgramWithSource(device->clContext(), 1, &source,
-                nullptr, &err);
+        const char *sources[] = { kernelPrelude, source };
+        auto program = clCreateProgramWithSource(device->clContext(), 2,
+                sources, nullptr, &err);
         if(err < 0)
             throw ProgramCompilationError(std::to_string(err));
 
@@ -34,15 +55,43 @@ Program::Program(std::shared_ptr<Runtime> runtime, const char *source,
             _programs.insert(std::pair<unsigned, _cl_program *>(device->id(),
                         program));
             _deviceTypes.insert(device->type());
+            if(device->nativeKernels())
+                _nativeDeviceTypes.insert(device->type());
         }
     }
 }
 
 Program::~Program() {
+    for(auto &it : _kernelCache) {
+        for(auto &cached : it.second)
+            clReleaseKernel(cached.kernel);
+    }
     for(auto &it : _programs)
         clReleaseProgram(it.second);
 }
 
+Program::CachedKernel Program::takeKernel(unsigned deviceID,
+        const std::string &name) {
+    std::lock_guard<std::mutex> lock(_kernelMutex);
+    auto it = _kernelCache.find(KernelKey(deviceID, name));
+    if(it == _kernelCache.end() || it->second.empty()) {
+        CachedKernel cached;
+        cached.kernel = nullptr;
+        cached.preferredMultiple = 0;
+        return cached;
+    }
+
+    auto cached = std::move(it->second.back());
+    it->second.pop_back();
+    return cached;
+}
+
+void Program::cacheKernel(unsigned deviceID, const std::string &name,
+        CachedKernel &&kernel) {
+    std::lock_guard<std::mutex> lock(_kernelMutex);
+    _kernelCache[KernelKey(deviceID, name)].push_back(std::move(kernel));
+}
+
 void Program::printBuildLog(_cl_program *program, Device &device) {
     size_t logSize;
     int err;
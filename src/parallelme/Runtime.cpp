@@ -61,6 +61,7 @@ void Runtime::startWorkers(JavaVM *jvm) {
 }
 
 void Runtime::submitTask(std::unique_ptr<Task> task) {
+    task->pinBuffers();
     _scheduler->push(std::move(task));
 
     for(auto &worker : _workers)
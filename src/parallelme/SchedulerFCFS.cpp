@@ -21,7 +21,7 @@ std::unique_ptr<Task> SchedulerFCFS::pop(Device &device){
     std::unique_lock<std::mutex> lock(_mutex);
 
     if(!_taskList.empty()
-            && _taskList.front()->program().hasDeviceID(device.id())) {
+            && _taskList.front()->runsOn(device)) {
         std::unique_ptr<Task> retTask = std::move(_taskList.front());
         _taskList.pop_front();
         return retTask;
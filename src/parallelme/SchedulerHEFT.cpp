@@ -16,20 +16,20 @@ void SchedulerHEFT::push(std::unique_ptr<Task> task) {
     double gpuCountScore = task->score().gpuScore;
     double cpuCountScore = task->score().cpuScore;
 
-    if(task->program().hasDeviceType(Device::CPU)) {
+    if(task->hasDeviceType(Device::CPU)) {
         std::lock_guard<std::mutex> lock(_cpuMutex);
         for(auto &it : _cpuTaskList)
             cpuCountScore += it->score().cpuScore;
     }
 
-    if(task->program().hasDeviceType(Device::GPU)) {
+    if(task->hasDeviceType(Device::GPU)) {
         std::lock_guard<std::mutex> lock(_gpuMutex);
         for(auto &it : _gpuTaskList)
             gpuCountScore += it->score().gpuScore;
     }
 
-    if(task->program().hasDeviceType(Device::CPU)
-            && task->program().hasDeviceType(Device::GPU)) {
+    if(task->hasDeviceType(Device::CPU)
+            && task->hasDeviceType(Device::GPU)) {
         if (cpuCountScore < gpuCountScore) {
             std::lock_guard<std::mutex> lock(_cpuMutex);
             _cpuTaskList.push_back(std::move(task));
@@ -39,11 +39,11 @@ void SchedulerHEFT::push(std::unique_ptr<Task> task) {
             _gpuTaskList.push_back(std::move(task));
         }
     }
-    else if(task->program().hasDeviceType(Device::CPU)) {
+    else if(task->hasDeviceType(Device::CPU)) {
         std::lock_guard<std::mutex> lock(_cpuMutex);
         _cpuTaskList.push_back(std::move(task));
     }
-    else if(task->program().hasDeviceType(Device::GPU)) {
+    else if(task->hasDeviceType(Device::GPU)) {
         std::lock_guard<std::mutex> lock(_gpuMutex);
         _gpuTaskList.push_back(std::move(task));
     }
@@ -57,7 +57,7 @@ std::unique_ptr<Task> SchedulerHEFT::pop(Device &device){
     if(device.type() == Device::CPU) {
         std::lock_guard<std::mutex> lock(_cpuMutex);
         if(!_cpuTaskList.empty()
-                && _cpuTaskList.front()->program().hasDeviceID(device.id())) {
+                && _cpuTaskList.front()->runsOn(device)) {
             std::unique_ptr <Task> retTask = std::move(_cpuTaskList.front());
             _cpuTaskList.pop_front();
             return retTask;
@@ -70,7 +70,7 @@ std::unique_ptr<Task> SchedulerHEFT::pop(Device &device){
     else if(device.type() == Device::GPU) {
         std::lock_guard<std::mutex> lock(_gpuMutex);
         if(!_gpuTaskList.empty()
-                && _gpuTaskList.front()->program().hasDeviceID(device.id())) {
+                && _gpuTaskList.front()->runsOn(device)) {
             std::unique_ptr <Task> retTask = std::move(_gpuTaskList.front());
             _gpuTaskList.pop_front();
             return retTask;
@@ -13,6 +13,10 @@
 using namespace parallelme;
 
 void SchedulerPAMS::push(std::unique_ptr<Task> task) {
+    if(!task->hasDeviceType(Device::CPU) && !task->hasDeviceType(Device::GPU))
+        throw std::runtime_error("Scheduler only supports CPU and GPU "
+                "workers.");
+
     std::lock_guard<std::mutex> lock(_mutex);
 
     float speedUpCPU = task->score().gpuScore / task->score().cpuScore;
@@ -22,7 +26,7 @@ void SchedulerPAMS::push(std::unique_ptr<Task> task) {
     TaskInfoListIt gpuIt = _gpuTaskList.end();
     taskReferences.task = task.get();
 
-    if(task->program().hasDeviceType(Device::GPU)) {
+    if(task->hasDeviceType(Device::GPU)) {
         if(_gpuTaskList.empty()) {
             gpuIt = _gpuTaskList.insert(gpuIt,
                 TaskInfoPair(speedUpGPU, taskReferences));
@@ -43,7 +47,7 @@ void SchedulerPAMS::push(std::unique_ptr<Task> task) {
         }
     }
 
-    if(task->program().hasDeviceType(Device::CPU)) {
+    if(task->hasDeviceType(Device::CPU)) {
         if(_cpuTaskList.empty()) {
             cpuIt = _cpuTaskList.insert(cpuIt,
                 TaskInfoPair(speedUpCPU, taskReferences));
@@ -64,14 +68,14 @@ void SchedulerPAMS::push(std::unique_ptr<Task> task) {
         }
     }
 
-    if(task->program().hasDeviceType(Device::CPU)
-            && task->program().hasDeviceType(Device::GPU)) {
+    if(task->hasDeviceType(Device::CPU)
+            && task->hasDeviceType(Device::GPU)) {
         gpuIt->second.itCPU = cpuIt;
         gpuIt->second.itGPU = gpuIt;
         cpuIt->second.itCPU = cpuIt;
         cpuIt->second.itGPU = gpuIt;
     }
-    else if(task->program().hasDeviceType(Device::CPU)) {
+    else if(task->hasDeviceType(Device::CPU)) {
         cpuIt->second.itCPU = cpuIt;
     }
     else /* if(task->hasDeviceType(GPU)) */ {
@@ -90,10 +94,10 @@ std::unique_ptr<Task> SchedulerPAMS::pop(Device &device) {
         auto it = _cpuTaskList.begin();
 
         if(!_cpuTaskList.empty()
-                && it->second.task->program().hasDeviceID(device.id())) {
+                && it->second.task->runsOn(device)) {
             retTask = it->second.task;
 
-            if(retTask->program().hasDeviceType(Device::GPU))
+            if(retTask->hasDeviceType(Device::GPU))
                 _gpuTaskList.erase(it->second.itGPU);
             _cpuTaskList.erase(it->second.itCPU);
         }
@@ -106,10 +110,10 @@ std::unique_ptr<Task> SchedulerPAMS::pop(Device &device) {
         auto it = _gpuTaskList.begin();
 
         if(!_gpuTaskList.empty()
-                && it->second.task->program().hasDeviceID(device.id())) {
+                && it->second.task->runsOn(device)) {
             retTask = it->second.task;
 
-            if(retTask->program().hasDeviceType(Device::CPU))
+            if(retTask->hasDeviceType(Device::CPU))
                 _cpuTaskList.erase(it->second.itCPU);
             _gpuTaskList.erase(it->second.itGPU);
         }
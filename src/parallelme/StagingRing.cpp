@@ -0,0 +1,119 @@
+/*                                                _    __ ____
+ *   _ __  ___ _____   ___   __  __   ___ __     / |  / /  __/
+ *  |  _ \/ _ |  _  | / _ | / / / /  / __/ /    /  | / / /__
+ *  |  __/ __ |  ___|/ __ |/ /_/ /__/ __/ /__  / / v  / /__
+ *  |_| /_/ |_|_|\_\/_/ |_/____/___/___/____/ /_/  /_/____/
+ *
+ */
+
+#include "StagingRing.hpp"
+#include <parallelme/Device.hpp>
+#include <parallelme/Profiler.hpp>
+#include <string>
+#include "dynloader/dynLoader.h"
+using namespace parallelme;
+
+constexpr unsigned StagingRing::NumSlots;
+
+StagingRing::StagingRing(Device &device) : _device(device), _next(0) {
+    for(auto &slot : _slots) {
+        slot.mem = nullptr;
+        slot.size = 0;
+        slot.event = nullptr;
+    }
+}
+
+StagingRing::~StagingRing() {
+    for(auto &slot : _slots) {
+        if(slot.event) {
+            clWaitForEvents(1, &slot.event);
+            clReleaseEvent(slot.event);
+        }
+        if(slot.mem) {
+            clReleaseMemObject(slot.mem);
+            _device.releaseMemory(slot.size);
+        }
+    }
+}
+
+void StagingRing::stage(size_t size, Buffer *owner, _cl_mem *dst,
+        size_t offset, const std::function<void (void *)> &fill) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto &slot = nextSlot(size, owner);
+
+    // Mapping pinned memory doesn't copy anything. The transfer queue is
+    // used so the host doesn't wait for the kernels of the compute queue.
+    int err;
+    auto transferQueue = _device.clTransferQueue();
+    void *host = clEnqueueMapBuffer(transferQueue, slot.mem, CL_TRUE,
+            CL_MAP_WRITE, 0, size, 0, nullptr, nullptr, &err);
+    if(err < 0)
+        throw StagingRingError(std::to_string(err));
+
+    try {
+        fill(host);
+    }
+    catch(...) {
+        clEnqueueUnmapMemObject(transferQueue, slot.mem, host, 0, nullptr,
+                nullptr);
+        throw;
+    }
+
+    _cl_event *unmapped;
+    err = clEnqueueUnmapMemObject(transferQueue, slot.mem, host, 0, nullptr,
+            &unmapped);
+    if(err < 0)
+        throw StagingRingError(std::to_string(err));
+    clFlush(transferQueue);
+
+    // The copy is ordered with the kernels that read its destination.
+    err = clEnqueueCopyBuffer(_device.clQueue(), slot.mem, dst, 0, offset,
+            size, 1, &unmapped, &slot.event);
+    clReleaseEvent(unmapped);
+    if(err < 0) {
+        slot.event = nullptr;
+        throw StagingRingError(std::to_string(err));
+    }
+
+    auto &profiler = Profiler::instance();
+    if(profiler.enabled()) {
+        clRetainEvent(slot.event);
+        profiler.record(_device.id(), "copy", Profiler::TransferCommand,
+                slot.event);
+    }
+}
+
+StagingRing::Slot &StagingRing::nextSlot(size_t size, Buffer *owner) {
+    auto &slot = _slots[_next];
+    _next = (_next + 1) % NumSlots;
+
+    if(slot.event) {
+        int err = clWaitForEvents(1, &slot.event);
+        clReleaseEvent(slot.event);
+        slot.event = nullptr;
+        if(err < 0)
+            throw StagingRingError(std::to_string(err));
+    }
+
+    if(slot.size < size) {
+        if(slot.mem) {
+            clReleaseMemObject(slot.mem);
+            _device.releaseMemory(slot.size);
+            slot.mem = nullptr;
+            slot.size = 0;
+        }
+
+        int err;
+        _device.reserveMemory(size, owner);
+        slot.mem = clCreateBuffer(_device.clContext(),
+                CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, size, nullptr, &err);
+        if(err < 0) {
+            _device.releaseMemory(size);
+            slot.mem = nullptr;
+            throw StagingRingError(std::to_string(err));
+        }
+        slot.size = size;
+    }
+
+    return slot;
+}
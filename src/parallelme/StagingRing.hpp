@@ -0,0 +1,94 @@
+/*                                                _    __ ____
+ *   _ __  ___ _____   ___   __  __   ___ __     / |  / /  __/
+ *  |  _ \/ _ |  _  | / _ | / / / /  / __/ /    /  | / / /__
+ *  |  __/ __ |  ___|/ __ |/ /_/ /__/ __/ /__  / / v  / /__
+ *  |_| /_/ |_|_|\_\/_/ |_/____/___/___/____/ /_/  /_/____/
+ *
+ */
+
+#ifndef PARALLELME_STAGINGRING_HPP
+#define PARALLELME_STAGINGRING_HPP
+
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+
+struct _cl_mem;
+struct _cl_event;
+
+namespace parallelme {
+class Buffer;
+class Device;
+
+/**
+ * Exception thrown if the staging ring failed to stage a transfer.
+ * The error message can be accessed through the what() function.
+ */
+class StagingRingError : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+/**
+ * Ring of pinned host memory objects of a device used to upload data that
+ * can only be accessed for a short time, like Java arrays and bitmaps.
+ * The data is copied to a slot of the ring on the host and then copied from
+ * the slot to its destination by the device, without blocking the host, so
+ * the source can be released right away. Slots are mapped on the transfer
+ * queue of the device, so staging doesn't wait for the queued kernels, and
+ * are reused in order, once the device finished reading them. The memory of
+ * the slots counts against the budget of the device.
+ *
+ * @author Renato Utsch
+ */
+class StagingRing {
+public:
+    /// Number of slots of the ring.
+    static constexpr unsigned NumSlots = 3;
+
+    /**
+     * Constructs the ring of the device. The copies from the slots are
+     * queued on its compute queue.
+     */
+    StagingRing(Device &device);
+    StagingRing(const StagingRing &) = delete;
+    StagingRing &operator=(const StagingRing &) = delete;
+
+    ~StagingRing();
+
+    /**
+     * Stages size bytes to be copied to the given offset of dst, a memory
+     * object of owner. The fill function receives the host pointer of the
+     * slot and must write the data to it. The copy to dst is only queued, and
+     * commands queued after this call see its result. Owner is never evicted
+     * to make room for the slot, as dst must outlive the copy.
+     */
+    void stage(size_t size, Buffer *owner, _cl_mem *dst, size_t offset,
+            const std::function<void (void *)> &fill);
+
+private:
+    /**
+     * Pinned memory object of the ring.
+     */
+    struct Slot {
+        _cl_mem *mem;       /// Memory object, nullptr if not created yet.
+        size_t size;        /// Size of mem.
+        _cl_event *event;   /// Last copy from the slot.
+    };
+
+    /**
+     * Returns the next slot, with at least size bytes, once the device
+     * finished reading it. Growing the slot may evict buffers other than
+     * owner.
+     */
+    Slot &nextSlot(size_t size, Buffer *owner);
+
+    Device &_device;
+    Slot _slots[NumSlots];
+    unsigned _next;         /// Index of the next slot to be used.
+    std::mutex _mutex;
+};
+
+}
+
+#endif // !PARALLELME_STAGINGRING_HPP
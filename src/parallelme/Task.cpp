@@ -7,36 +7,422 @@
  */
 
 #include <parallelme/Task.hpp>
+#include <parallelme/Buffer.hpp>
 #include <parallelme/Device.hpp>
+#include <parallelme/Event.hpp>
 #include <parallelme/Kernel.hpp>
 #include <parallelme/Program.hpp>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include "dynloader/dynLoader.h"
 #include "util/error.h"
 using namespace parallelme;
 
+/// Smallest weight of a device in the split, so it keeps being measured.
+static const double MinSplitWeight = 0.02;
+
+/// Weights of the devices in the split of each co-executed task.
+static std::map<std::string, std::map<unsigned, double>> splitWeights;
+static std::mutex splitMutex;
+
+/**
+ * Times when the devices started and finished the parts of a co-executed
+ * task.
+ */
+struct PartCompletion {
+    std::vector<std::chrono::steady_clock::time_point> starts;
+    std::vector<std::chrono::steady_clock::time_point> ends;
+    size_t pending;
+    std::mutex mutex;
+    std::condition_variable cv;
+};
+
+/**
+ * Marker of a part given to its completion callback.
+ */
+struct PartSlot {
+    std::shared_ptr<PartCompletion> completion;
+    size_t part;
+    bool start;     /// If the marker is queued before the part's kernels.
+};
+
+/// Records when a device reached the marker of a part.
+static void CL_CALLBACK recordCompletion(cl_event, cl_int, void *data) {
+    auto slot = (PartSlot *) data;
+    auto &completion = *slot->completion;
+    {
+        std::lock_guard<std::mutex> lock(completion.mutex);
+        auto &times = slot->start ? completion.starts : completion.ends;
+        times[slot->part] = std::chrono::steady_clock::now();
+        --completion.pending;
+    }
+    completion.cv.notify_all();
+    delete slot;
+}
+
 Task::Task(std::shared_ptr<Program> program, Score score) : _score(score),
-        _configFunction(nullptr), _program(program) {
+        _configFunction(nullptr), _program(program), _pinned(false) {
+    _tiling.tileRows = 0;
 
 }
 
-Task::~Task() = default;
+Task::~Task() {
+    if(_pinned) {
+        for(auto &buffer : _buffers)
+            buffer->unpin();
+    }
+}
 
 Task *Task::addKernel(const std::string &name) {
     _kernelNames.push_back(name);
     return this;
 }
 
+Task *Task::addNativeKernel(const std::string &name,
+        NativeFunction function) {
+    if(!_program->hasNativeDevice())
+        throw InvalidKernelError("No device of the program executes native "
+                "kernels.");
+
+    _kernelNames.push_back(name);
+    _nativeFunctions[name] = function;
+    return this;
+}
+
+Task *Task::addBuffer(std::shared_ptr<Buffer> buffer) {
+    _buffers.push_back(buffer);
+    if(_pinned)
+        buffer->pin();
+    return this;
+}
+
+void Task::pinBuffers() {
+    if(_pinned)
+        return;
+
+    for(auto &buffer : _buffers)
+        buffer->pin();
+    _pinned = true;
+}
+
+bool Task::runsOn(Device &device) const {
+    return _program->hasDeviceID(device.id())
+        && (_nativeFunctions.empty() || device.nativeKernels());
+}
+
+bool Task::hasDeviceType(Device::Type type) const {
+    if(_nativeFunctions.empty())
+        return _program->hasDeviceType(type);
+    return _program->hasNativeDeviceType(type);
+}
+
+Task *Task::setTiling(void *input, size_t inputRowSize, void *output,
+        size_t outputRowSize, size_t rows, size_t tileRows, size_t haloRows) {
+    if(!input || !output || !inputRowSize || !outputRowSize || !rows)
+        throw InvalidTilingError("The input and output must not be empty.");
+    if(!tileRows)
+        throw InvalidTilingError("The tiles must have at least one row.");
+
+    _tiling.input = input;
+    _tiling.inputRowSize = inputRowSize;
+    _tiling.output = output;
+    _tiling.outputRowSize = outputRowSize;
+    _tiling.rows = rows;
+    _tiling.tileRows = tileRows < rows ? tileRows : rows;
+    _tiling.haloRows = haloRows;
+    return this;
+}
+
+Task *Task::setCoExecution(std::vector<DevicePtr> devices) {
+    _coDevices = std::move(devices);
+    return this;
+}
+
 void Task::createKernels(std::shared_ptr<Device> &device) {
+    createKernels(device, _kernels, _kernelHash);
+    if(!_coDevices.empty() && !_tiling.tileRows && _nativeFunctions.empty())
+        createParts(device);
+}
+
+void Task::createKernels(std::shared_ptr<Device> &device,
+        std::vector<std::shared_ptr<Kernel>> &kernels,
+        KernelHash &kernelHash) {
     for(auto &name : _kernelNames) {
         // I don't use std::make_shared here because Kernel's constructor is private.
-        auto kernel = std::shared_ptr<Kernel>(new Kernel(name, device, *_program));
+        auto native = _nativeFunctions.find(name);
+        auto kernel = std::shared_ptr<Kernel>(native != _nativeFunctions.end()
+                ? new Kernel(name, device, native->second)
+                : new Kernel(name, device, _program));
 
-        _kernels.push_back(kernel);
-        _kernelHash.insert(std::pair<std::string, Kernel *>(name, kernel.get()));
+        kernels.push_back(kernel);
+        kernelHash.insert(std::pair<std::string, Kernel *>(name, kernel.get()));
     }
 }
 
-void Task::run() {
+void Task::createParts(std::shared_ptr<Device> &device) {
+    for(auto &other : _coDevices) {
+        if(other == device || !_program->hasDeviceID(other->id()))
+            continue;
+
+        Part part;
+        part.device = other;
+        createKernels(other, part.kernels, part.kernelHash);
+        _parts.push_back(std::move(part));
+    }
+    if(_parts.empty())
+        return;
+
+    // Devices that didn't execute the task yet start with its score.
+    std::vector<double> weights;
+    {
+        std::lock_guard<std::mutex> lock(splitMutex);
+        auto &known = splitWeights[splitKey()];
+        for(size_t i = 0; i <= _parts.size(); ++i) {
+            auto &partDevice = i ? _parts[i - 1].device : device;
+            auto it = known.find(partDevice->id());
+            if(it != known.end()) {
+                weights.push_back(it->second);
+                continue;
+            }
+
+            switch(partDevice->type()) {
+            case Device::CPU: weights.push_back(_score.cpuScore); break;
+            case Device::GPU: weights.push_back(_score.gpuScore); break;
+            default: weights.push_back(_score.acceleratorScore); break;
+            }
+        }
+    }
+
+    double total = 0.0;
+    for(auto &weight : weights) {
+        weight = std::max(weight, MinSplitWeight);
+        total += weight;
+    }
+
+    _split.assign(1, 0.0);
+    for(auto weight : weights)
+        _split.push_back(_split.back() + weight / total);
+    _split.back() = 1.0;
+
+    for(auto &kernel : _kernels)
+        kernel->setPart(_split[0], _split[1]);
+    for(size_t i = 0; i < _parts.size(); ++i) {
+        for(auto &kernel : _parts[i].kernels)
+            kernel->setPart(_split[i + 1], _split[i + 2]);
+    }
+}
+
+void Task::run(std::shared_ptr<Device> &device) {
+    if(_tiling.tileRows)
+        runTiles(device);
+    else if(!_parts.empty())
+        runParts(device);
+    else
+        runKernels();
+}
+
+void Task::runKernels() {
     for(auto &kernel : _kernels)
         kernel->run();
 }
 
+void Task::runTiles(std::shared_ptr<Device> &device) {
+    auto &tiling = _tiling;
+    size_t inputSize = (tiling.tileRows + 2 * tiling.haloRows)
+        * tiling.inputRowSize;
+    size_t outputSize = tiling.tileRows * tiling.outputRowSize;
+    std::shared_ptr<Buffer> inputs[] = {
+        std::make_shared<Buffer>(inputSize),
+        std::make_shared<Buffer>(inputSize)
+    };
+    std::shared_ptr<Buffer> outputs[] = {
+        std::make_shared<Buffer>(outputSize),
+        std::make_shared<Buffer>(outputSize)
+    };
+
+    auto inputRows = [&tiling] (const Tile &tile) {
+        return (char *) tiling.input
+            + (tile.firstRow - tile.haloBefore) * tiling.inputRowSize;
+    };
+    auto outputRows = [&tiling] (const Tile &tile) {
+        return (char *) tiling.output + tile.firstRow * tiling.outputRowSize;
+    };
+
+    // The transfers are queued on the transfer queue of the device and the
+    // buffers make the kernels wait for them, so the host only waits for the
+    // last download.
+    size_t numTiles = (tiling.rows + tiling.tileRows - 1) / tiling.tileRows;
+    auto next = tile(0, inputs[0], outputs[0]);
+    next.input->setSourceAsync(inputRows(next), device);
+    std::shared_ptr<Event> download;
+
+    for(size_t i = 0; i < numTiles; ++i) {
+        auto current = next;
+        if(i + 1 < numTiles) {
+            next = tile(i + 1, inputs[(i + 1) % 2], outputs[(i + 1) % 2]);
+            next.input->setSourceAsync(inputRows(next), device);
+        }
+
+        if(_tileFunction)
+            _tileFunction(device, _kernelHash, current);
+        runKernels();
+        download = current.output->copyToAsync(outputRows(current));
+    }
+
+    download->wait();
+}
+
+void Task::runParts(std::shared_ptr<Device> &device) {
+    size_t numParts = _parts.size() + 1;
+    auto completion = std::make_shared<PartCompletion>();
+    completion->starts.resize(numParts);
+    completion->ends.resize(numParts);
+    completion->pending = 0;
+    std::vector<_cl_event *> markers;
+
+    // Only the device of this worker began a task, so the buffers of the
+    // other parts are pinned to keep their devices from evicting them.
+    std::vector<std::shared_ptr<Buffer>> pinned;
+    for(auto &part : _parts) {
+        for(auto &kernel : part.kernels) {
+            for(auto &arg : kernel->_bufferArgs) {
+                arg.buffer->pin();
+                pinned.push_back(arg.buffer);
+            }
+        }
+    }
+
+    // The devices record when they reach the markers, so the time of a part
+    // doesn't include the host work of the parts queued before it.
+    auto mark = [&] (std::shared_ptr<Device> &partDevice, size_t part,
+            bool start) {
+        _cl_event *marker;
+        int err = clEnqueueMarker(partDevice->clQueue(), &marker);
+        if(err < 0)
+            throw KernelExecutionError(std::to_string(err));
+        markers.push_back(marker);
+
+        auto slot = new PartSlot{completion, part, start};
+        {
+            std::lock_guard<std::mutex> lock(completion->mutex);
+            ++completion->pending;
+        }
+        err = clSetEventCallback(marker, CL_COMPLETE, recordCompletion, slot);
+        if(err < 0) {
+            delete slot;
+            std::lock_guard<std::mutex> lock(completion->mutex);
+            --completion->pending;
+        }
+    };
+
+    // All the parts are queued and flushed before waiting for any of them.
+    // The kernels bind their arguments through the JNIEnv of this thread.
+    auto enqueue = [&] () {
+        for(size_t i = 0; i < numParts; ++i) {
+            auto &partDevice = i ? _parts[i - 1].device : device;
+            mark(partDevice, i, true);
+            for(auto &kernel : i ? _parts[i - 1].kernels : _kernels)
+                kernel->run();
+            mark(partDevice, i, false);
+            clFlush(partDevice->clQueue());
+        }
+    };
+
+    // The callbacks may still run after an error, so they are waited for.
+    // Each device has its own context, so its marker is waited for alone.
+    auto wait = [&] () {
+        int err = 0;
+        for(auto &marker : markers) {
+            int markerErr = clWaitForEvents(1, &marker);
+            if(markerErr < 0 && err >= 0)
+                err = markerErr;
+        }
+        std::unique_lock<std::mutex> lock(completion->mutex);
+        completion->cv.wait(lock, [&] { return !completion->pending; });
+        for(auto marker : markers)
+            clReleaseEvent(marker);
+        return err;
+    };
+
+    try {
+        enqueue();
+    }
+    catch(...) {
+        wait();
+        for(auto &buffer : pinned)
+            buffer->unpin();
+        throw;
+    }
+    int err = wait();
+    for(auto &buffer : pinned)
+        buffer->unpin();
+    if(err < 0)
+        throw KernelExecutionError(std::to_string(err));
+
+    // Each device gets a share of the range proportional to the throughput
+    // it had, averaged with the previous share so the split doesn't swing.
+    auto key = splitKey();
+    std::lock_guard<std::mutex> lock(splitMutex);
+    auto &weights = splitWeights[key];
+    std::vector<double> throughputs(numParts, 0.0);
+    double measuredShare = 0.0, totalThroughput = 0.0;
+    for(size_t i = 0; i < numParts; ++i) {
+        // Markers without a callback leave their times unset.
+        double share = _split[i + 1] - _split[i];
+        auto unset = std::chrono::steady_clock::time_point();
+        std::chrono::duration<double> elapsed = completion->ends[i]
+            - completion->starts[i];
+        if(share <= 0.0 || elapsed.count() <= 0.0
+                || completion->starts[i] == unset)
+            continue;
+
+        throughputs[i] = share / elapsed.count();
+        measuredShare += share;
+        totalThroughput += throughputs[i];
+    }
+
+    for(size_t i = 0; i < numParts && totalThroughput > 0.0; ++i) {
+        if(throughputs[i] <= 0.0)
+            continue;
+
+        auto &partDevice = i ? _parts[i - 1].device : device;
+        double share = _split[i + 1] - _split[i];
+        double target = measuredShare * throughputs[i] / totalThroughput;
+        weights[partDevice->id()] = std::max((share + target) / 2.0,
+                MinSplitWeight);
+    }
+}
+
+std::string Task::splitKey() {
+    std::ostringstream key;
+    key << _program->sourceHash();
+    for(auto &name : _kernelNames)
+        key << ' ' << name;
+    return key.str();
+}
+
+Task::Tile Task::tile(size_t index, std::shared_ptr<Buffer> &input,
+        std::shared_ptr<Buffer> &output) {
+    auto &tiling = _tiling;
+    Tile tile;
+    tile.firstRow = index * tiling.tileRows;
+    tile.rows = std::min(tiling.tileRows, tiling.rows - tile.firstRow);
+    tile.haloBefore = std::min(tiling.haloRows, tile.firstRow);
+    tile.haloAfter = std::min(tiling.haloRows,
+            tiling.rows - tile.firstRow - tile.rows);
+
+    // The last tile may be smaller than the buffers.
+    size_t inputSize = (tile.haloBefore + tile.rows + tile.haloAfter)
+        * tiling.inputRowSize;
+    size_t outputSize = tile.rows * tiling.outputRowSize;
+    tile.input = inputSize < input->size() ? input->view(0, inputSize) : input;
+    tile.output = outputSize < output->size() ? output->view(0, outputSize)
+        : output;
+
+    return tile;
+}
+
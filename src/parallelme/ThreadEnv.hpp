@@ -0,0 +1,63 @@
+/*                                                _    __ ____
+ *   _ __  ___ _____   ___   __  __   ___ __     / |  / /  __/
+ *  |  _ \/ _ |  _  | / _ | / / / /  / __/ /    /  | / / /__
+ *  |  __/ __ |  ___|/ __ |/ /_/ /__/ __/ /__  / / v  / /__
+ *  |_| /_/ |_|_|\_\/_/ |_/____/___/___/____/ /_/  /_/____/
+ *
+ */
+
+#ifndef PARALLELME_THREADENV_HPP
+#define PARALLELME_THREADENV_HPP
+
+#include <jni.h>
+
+namespace parallelme {
+
+/**
+ * JNIEnv of the calling thread. A JNIEnv can only be used by the thread it
+ * belongs to, so Java sources are accessed through this instead of the
+ * JNIEnv of a device's worker. The thread is attached to the VM while this
+ * object is in scope if it wasn't already.
+ *
+ * @author Renato Utsch
+ */
+class ThreadEnv {
+public:
+    /**
+     * Gets the JNIEnv of the calling thread from vm, which may be nullptr
+     * if there are no Java objects to access.
+     */
+    ThreadEnv(JavaVM *vm) : _vm(vm), _env(nullptr), _attached(false) {
+        if(!vm || vm->GetEnv((void **) &_env, JNI_VERSION_1_6) == JNI_OK)
+            return;
+
+        _attached = !vm->AttachCurrentThread(&_env, nullptr);
+        if(!_attached)
+            _env = nullptr;
+    }
+
+    ThreadEnv(const ThreadEnv &) = delete;
+    ThreadEnv &operator=(const ThreadEnv &) = delete;
+
+    ~ThreadEnv() {
+        if(_attached)
+            _vm->DetachCurrentThread();
+    }
+
+    /**
+     * Returns the JNIEnv, or nullptr if there is no VM or the thread
+     * couldn't be attached to it.
+     */
+    inline JNIEnv *get() {
+        return _env;
+    }
+
+private:
+    JavaVM *_vm;
+    JNIEnv *_env;
+    bool _attached;     /// If the thread was attached by this object.
+};
+
+}
+
+#endif // !PARALLELME_THREADENV_HPP
@@ -0,0 +1,158 @@
+/*                                                _    __ ____
+ *   _ __  ___ _____   ___   __  __   ___ __     / |  / /  __/
+ *  |  _ \/ _ |  _  | / _ | / / / /  / __/ /    /  | / / /__
+ *  |  __/ __ |  ___|/ __ |/ /_/ /__/ __/ /__  / / v  / /__
+ *  |_| /_/ |_|_|\_\/_/ |_/____/___/___/____/ /_/  /_/____/
+ *
+ */
+
+#include "TransferEngine.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__)
+#   include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#   include <arm_neon.h>
+#endif
+
+using namespace parallelme;
+
+constexpr size_t TransferEngine::ParallelThreshold;
+constexpr size_t TransferEngine::StreamThreshold;
+constexpr size_t TransferEngine::MinChunkSize;
+
+TransferEngine &TransferEngine::instance() {
+    static TransferEngine engine;
+    return engine;
+}
+
+TransferEngine::TransferEngine() : _generation(0), _stop(false) {
+    unsigned cores = std::thread::hardware_concurrency();
+    for(unsigned i = 1; i < cores; ++i)
+        _threads.push_back(std::thread(&TransferEngine::work, this));
+}
+
+TransferEngine::~TransferEngine() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _startCv.notify_all();
+
+    for(auto &thread : _threads)
+        thread.join();
+}
+
+void TransferEngine::copy(void *dst, const void *src, size_t size) {
+    if(size < StreamThreshold) {
+        memcpy(dst, src, size);
+        return;
+    }
+
+    std::unique_lock<std::mutex> copyLock(_copyMutex, std::try_to_lock);
+    if(size < ParallelThreshold || _threads.empty() || !copyLock.owns_lock()) {
+        streamCopy((char *) dst, (const char *) src, size);
+        return;
+    }
+
+    // Chunks are multiples of the cache line so threads don't share lines.
+    size_t chunkSize = std::max(size / ((_threads.size() + 1) * 4),
+            MinChunkSize);
+    chunkSize = (chunkSize + 63) / 64 * 64;
+
+    auto job = std::make_shared<Job>();
+    job->dst = (char *) dst;
+    job->src = (const char *) src;
+    job->size = size;
+    job->chunkSize = chunkSize;
+    job->numChunks = (size + chunkSize - 1) / chunkSize;
+    job->nextChunk = 0;
+    job->doneChunks = 0;
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    _job = job;
+    ++_generation;
+    lock.unlock();
+    _startCv.notify_all();
+
+    copyChunks(*job);
+
+    // Threads that wake up late only find the chunks of their job taken.
+    lock.lock();
+    _doneCv.wait(lock, [&job] {
+        return job->doneChunks == job->numChunks;
+    });
+    _job.reset();
+}
+
+void TransferEngine::work() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    unsigned generation = _generation;
+
+    for(;;) {
+        _startCv.wait(lock, [&] {
+            return _stop || _generation != generation;
+        });
+        if(_stop)
+            return;
+        generation = _generation;
+        auto job = _job;
+        if(!job)
+            continue;
+
+        lock.unlock();
+        copyChunks(*job);
+        lock.lock();
+        _doneCv.notify_one();
+    }
+}
+
+void TransferEngine::copyChunks(Job &job) {
+    for(size_t chunk = job.nextChunk++; chunk < job.numChunks;
+            chunk = job.nextChunk++) {
+        size_t begin = chunk * job.chunkSize;
+        size_t size = std::min(job.chunkSize, job.size - begin);
+        streamCopy(job.dst + begin, job.src + begin, size);
+        ++job.doneChunks;
+    }
+}
+
+void TransferEngine::streamCopy(char *dst, const char *src, size_t size) {
+#if defined(__SSE2__)
+    // Streaming stores need an aligned destination.
+    size_t head = std::min((16 - (uintptr_t) dst % 16) % 16, size);
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    size -= head;
+
+    for(; size >= 64; size -= 64, dst += 64, src += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *) src);
+        __m128i b = _mm_loadu_si128((const __m128i *) (src + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *) (src + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *) (src + 48));
+        _mm_stream_si128((__m128i *) dst, a);
+        _mm_stream_si128((__m128i *) (dst + 16), b);
+        _mm_stream_si128((__m128i *) (dst + 32), c);
+        _mm_stream_si128((__m128i *) (dst + 48), d);
+    }
+    _mm_sfence();
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    // NEON has no non-temporal stores, but wide loads and stores still beat
+    // the byte loops of some memcpy() implementations.
+    for(; size >= 64; size -= 64, dst += 64, src += 64) {
+        uint8x16_t a = vld1q_u8((const uint8_t *) src);
+        uint8x16_t b = vld1q_u8((const uint8_t *) (src + 16));
+        uint8x16_t c = vld1q_u8((const uint8_t *) (src + 32));
+        uint8x16_t d = vld1q_u8((const uint8_t *) (src + 48));
+        vst1q_u8((uint8_t *) dst, a);
+        vst1q_u8((uint8_t *) (dst + 16), b);
+        vst1q_u8((uint8_t *) (dst + 32), c);
+        vst1q_u8((uint8_t *) (dst + 48), d);
+    }
+#endif
+
+    memcpy(dst, src, size);
+}
@@ -0,0 +1,101 @@
+/*                                                _    __ ____
+ *   _ __  ___ _____   ___   __  __   ___ __     / |  / /  __/
+ *  |  _ \/ _ |  _  | / _ | / / / /  / __/ /    /  | / / /__
+ *  |  __/ __ |  ___|/ __ |/ /_/ /__/ __/ /__  / / v  / /__
+ *  |_| /_/ |_|_|\_\/_/ |_/____/___/___/____/ /_/  /_/____/
+ *
+ */
+
+#ifndef PARALLELME_TRANSFERENGINE_HPP
+#define PARALLELME_TRANSFERENGINE_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace parallelme {
+
+/**
+ * Copies host memory for the buffer transfers. Large copies are split in
+ * chunks that a pool of host threads copies in parallel with SIMD
+ * instructions, using non-temporal stores where available so that the copy
+ * doesn't evict the caches. Small copies are left to memcpy().
+ *
+ * @author Renato Utsch
+ */
+class TransferEngine {
+public:
+    /// Copies smaller than this many bytes run on the calling thread only.
+    static constexpr size_t ParallelThreshold = 4 * 1024 * 1024;
+
+    /// Copies smaller than this many bytes use memcpy().
+    static constexpr size_t StreamThreshold = 256 * 1024;
+
+    /// Minimum size in bytes of the chunks copied by each thread.
+    static constexpr size_t MinChunkSize = 1024 * 1024;
+
+    /**
+     * Returns the engine shared by all buffers.
+     */
+    static TransferEngine &instance();
+
+    TransferEngine(const TransferEngine &) = delete;
+    TransferEngine &operator=(const TransferEngine &) = delete;
+
+    ~TransferEngine();
+
+    /**
+     * Copies size bytes from src to dst, which must not overlap. If another
+     * thread is already using the pool, the copy runs on the calling thread.
+     */
+    void copy(void *dst, const void *src, size_t size);
+
+private:
+    /**
+     * Parameters and progress of a copy, kept alive by the threads that
+     * copy its chunks.
+     */
+    struct Job {
+        char *dst;                      /// Destination of the copy.
+        const char *src;                /// Source of the copy.
+        size_t size;                    /// Size of the copy.
+        size_t chunkSize;               /// Size of each chunk.
+        size_t numChunks;               /// Number of chunks.
+        std::atomic<size_t> nextChunk;  /// Next chunk to be copied.
+        std::atomic<size_t> doneChunks; /// Chunks already copied.
+    };
+
+    /**
+     * Starts the threads of the pool. The calling thread of a copy also
+     * copies chunks, so one less thread than the number of cores is started.
+     */
+    TransferEngine();
+
+    /// Loop of the threads of the pool.
+    void work();
+
+    /// Copies the chunks of the job until there are none left.
+    static void copyChunks(Job &job);
+
+    /**
+     * Copies with SIMD loads and non-temporal stores on the calling thread.
+     */
+    static void streamCopy(char *dst, const char *src, size_t size);
+
+    std::vector<std::thread> _threads;  /// Threads of the pool.
+    std::mutex _copyMutex;              /// Held by the thread using the pool.
+    std::mutex _mutex;                  /// Guards the state of the copy.
+    std::condition_variable _startCv;   /// Wakes up the pool.
+    std::condition_variable _doneCv;    /// Wakes up the calling thread.
+    unsigned _generation;               /// Number of the current copy.
+    bool _stop;                         /// If the threads must exit.
+    std::shared_ptr<Job> _job;          /// Current copy.
+};
+
+}
+
+#endif // !PARALLELME_TRANSFERENGINE_HPP
@@ -0,0 +1,217 @@
+/*                                                _    __ ____
+ *   _ __  ___ _____   ___   __  __   ___ __     / |  / /  __/
+ *  |  _ \/ _ |  _  | / _ | / / / /  / __/ /    /  | / / /__
+ *  |  __/ __ |  ___|/ __ |/ /_/ /__/ __/ /__  / / v  / /__
+ *  |_| /_/ |_|_|\_\/_/ |_/____/___/___/____/ /_/  /_/____/
+ *
+ */
+
+#include <parallelme/WorkGroupTuner.hpp>
+#include <parallelme/Device.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include "dynloader/dynLoader.h"
+#include "util/error.h"
+using namespace parallelme;
+
+/// Returns the smallest power of two not smaller than size.
+static size_t ceilPowerOfTwo(size_t size) {
+    size_t power = 1;
+    while(power < size)
+        power <<= 1;
+    return power;
+}
+
+/// Returns the largest power of two that divides size, up to 1024.
+static size_t powerOfTwoDivisor(size_t size) {
+    return size ? std::min(size & (~size + 1), (size_t) 1024) : 1;
+}
+
+WorkGroupTuner &WorkGroupTuner::instance() {
+    static WorkGroupTuner tuner;
+    return tuner;
+}
+
+WorkGroupTuner::WorkGroupTuner() : _enabled(false) {
+
+}
+
+void WorkGroupTuner::setCachePath(const std::string &path) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _path = path;
+
+    // Each line has a key followed by the three sizes of its shape.
+    std::ifstream file(path);
+    std::string line;
+    while(std::getline(file, line)) {
+        std::istringstream fields(line);
+        std::string key;
+        Shape shape;
+        if(!(fields >> key >> shape[0] >> shape[1] >> shape[2]))
+            continue;
+
+        auto &entry = _entries[key];
+        entry.best = shape;
+        entry.warm = true;
+        entry.tuned = true;
+    }
+}
+
+void WorkGroupTuner::setEnabled(bool enabled) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _enabled = enabled;
+}
+
+WorkGroupTuner::Choice WorkGroupTuner::choose(Device &device,
+        _cl_kernel *kernel, uint64_t program, const std::string &name,
+        const size_t global[3]) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    Choice choice;
+    choice.local = Shape{{ 0, 0, 0 }};
+    choice.trial = -1;
+    if(!_enabled)
+        return choice;
+
+    // Sizes of the same class have the same magnitude and the same power of
+    // two divisors, so the shapes tuned for one divide all the others.
+    std::ostringstream key;
+    key << deviceSignature(device) << '|' << std::hex << program << std::dec
+        << '|' << name;
+    for(unsigned i = 0; i < 3; ++i) {
+        key << '|' << ceilPowerOfTwo(global[i]) << '/'
+            << powerOfTwoDivisor(global[i]);
+    }
+    choice.key = key.str();
+
+    auto it = _entries.find(choice.key);
+    if(it == _entries.end()) {
+        Entry entry;
+        entry.candidates = candidates(device, kernel, global);
+        entry.best = choice.local;
+        entry.warm = false;
+        entry.tuned = entry.candidates.size() < 2;
+        it = _entries.insert(std::make_pair(choice.key, entry)).first;
+    }
+
+    auto &entry = it->second;
+    if(entry.tuned) {
+        choice.local = entry.best;
+    }
+    else if(!entry.warm) {
+        // The first execution also pays for the driver's setup.
+        entry.warm = true;
+    }
+    else {
+        choice.trial = entry.times.size();
+        choice.local = entry.candidates[choice.trial];
+    }
+
+    return choice;
+}
+
+void WorkGroupTuner::finishTrial(const Choice &choice, double seconds) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _entries.find(choice.key);
+    if(it == _entries.end() || it->second.tuned
+            || choice.trial != (int) it->second.times.size())
+        return;
+
+    auto &entry = it->second;
+    entry.times.push_back(seconds < 0.0
+            ? std::numeric_limits<double>::infinity() : seconds);
+    if(entry.times.size() < entry.candidates.size())
+        return;
+
+    auto fastest = std::min_element(entry.times.begin(), entry.times.end());
+    entry.best = entry.candidates[fastest - entry.times.begin()];
+    entry.tuned = true;
+    entry.candidates.clear();
+    entry.times.clear();
+    save();
+}
+
+std::string WorkGroupTuner::deviceSignature(Device &device) {
+    auto it = _signatures.find(device.id());
+    if(it != _signatures.end())
+        return it->second;
+
+    std::string signature;
+    cl_device_info params[] = { CL_DEVICE_NAME, CL_DRIVER_VERSION };
+    for(auto param : params) {
+        char value[256] = "";
+        clGetDeviceInfo(device.clDevice(), param, sizeof(value) - 1, value,
+                nullptr);
+        signature += signature.empty() ? "" : "|";
+        signature += value;
+    }
+
+    // Keys are read back as a single word.
+    std::replace_if(signature.begin(), signature.end(),
+            [] (char c) { return c == ' ' || c == '\t' || c == '\n'; }, '_');
+    _signatures.insert(std::make_pair(device.id(), signature));
+    return signature;
+}
+
+std::vector<WorkGroupTuner::Shape> WorkGroupTuner::candidates(Device &device,
+        _cl_kernel *kernel, const size_t global[3]) {
+    // The driver's choice is always a candidate and the fallback on errors.
+    std::vector<Shape> shapes = { Shape{{ 0, 0, 0 }} };
+
+    size_t maxSize, multiple;
+    size_t maxItems[3];
+    if(clGetKernelWorkGroupInfo(kernel, device.clDevice(),
+                CL_KERNEL_WORK_GROUP_SIZE, sizeof(maxSize), &maxSize,
+                nullptr) < 0
+            || clGetKernelWorkGroupInfo(kernel, device.clDevice(),
+                CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+                sizeof(multiple), &multiple, nullptr) < 0
+            || clGetDeviceInfo(device.clDevice(),
+                CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(maxItems), maxItems,
+                nullptr) < 0)
+        return shapes;
+
+    // Small groups leave the device idle, so only the shapes with at least
+    // an eighth of the maximum size and the preferred multiple are tried.
+    size_t minSize = std::min(std::max(maxSize / 8, multiple), maxSize);
+    size_t yLimit = global[1] > 1 ? maxItems[1] : 1;
+    for(size_t x = 1; x <= maxItems[0] && x <= maxSize; x <<= 1) {
+        if(global[0] % x)
+            break;
+        for(size_t y = 1; y <= yLimit && x * y <= maxSize; y <<= 1) {
+            if(global[1] % y)
+                break;
+            if(x * y >= minSize)
+                shapes.push_back(Shape{{ x, y, 1 }});
+        }
+    }
+
+    return shapes;
+}
+
+void WorkGroupTuner::save() {
+    if(_path.empty())
+        return;
+
+    // Replacing the file at once keeps it whole if the application dies.
+    std::string temporary = _path + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::trunc);
+        for(auto &it : _entries) {
+            if(!it.second.tuned)
+                continue;
+            auto &shape = it.second.best;
+            file << it.first << ' ' << shape[0] << ' ' << shape[1] << ' '
+                << shape[2] << '\n';
+        }
+        if(!file) {
+            printError("Failed to write %s", temporary.c_str());
+            return;
+        }
+    }
+
+    if(rename(temporary.c_str(), _path.c_str()) < 0)
+        printError("Failed to replace %s", _path.c_str());
+}
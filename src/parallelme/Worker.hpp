@@ -36,9 +36,10 @@ class Worker {
 
     /// Executes a given task.
     void executeTask(std::unique_ptr<Task> task) {
+        _device->beginTask();
         task->createKernels(_device);
         task->callConfigFunction(_device);
-        task->run();
+        task->run(_device);
         task->callFinishFunction(_device);
         _device->finish();
     }